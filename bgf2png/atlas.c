@@ -0,0 +1,901 @@
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "bgf.h"
+
+#define STB_RECT_PACK_IMPLEMENTATION
+#include "atlas.h"
+
+// number of target widths tried between the lower and upper bound
+#define PACK_WIDTH_STEPS 12
+// runs of units added to a page before it counts as full
+#define PAGE_FILL_ROUNDS 8
+
+static const int pack_heuristics[] = { STBRP_HEURISTIC_Skyline_BL_sortHeight,
+				       STBRP_HEURISTIC_Skyline_BF_sortHeight };
+#define PACK_HEURISTIC_COUNT \
+	(int)(sizeof(pack_heuristics) / sizeof(*pack_heuristics))
+
+// one attempt of the size search, width and height are 0 if it failed
+struct pack_candidate {
+	int target_width;
+	int heuristic;
+	int width, height;
+};
+
+/* Shared between packing threads. Each thread claims the next untried
+ * candidate and packs its own copy of the rects, so candidates are tried in
+ * parallel without any locking around stb_rect_pack itself.
+ */
+struct pack_search {
+	const struct stbrp_rect *rects;
+	int rect_count;
+	int max_dim;
+	struct pack_candidate *candidates;
+	int candidate_count;
+	int next_candidate;
+	pthread_mutex_t lock;
+};
+
+/* Packs rects into a target_width wide and max_dim tall area and records how
+ * much of it was actually used. The target is as tall as allowed, so a
+ * single pass per width is enough to find the height it needs.
+ */
+void try_candidate(struct pack_candidate *c, struct stbrp_rect *rects,
+		   int rect_count, int max_dim, struct stbrp_node *nodes)
+{
+	struct stbrp_context ctx;
+
+	stbrp_init_target(&ctx, c->target_width, max_dim, nodes,
+			  c->target_width);
+	stbrp_setup_heuristic(&ctx, c->heuristic);
+
+	c->width = 0;
+	c->height = 0;
+	if (!stbrp_pack_rects(&ctx, rects, rect_count))
+		return;
+
+	// rects can all be empty, such as fully transparent frames trimmed
+	// without padding, and still need a 1x1 page
+	c->width = 1;
+	c->height = 1;
+	for (int i = 0; i < rect_count; i++) {
+		if (rects[i].x + rects[i].w > c->width)
+			c->width = rects[i].x + rects[i].w;
+		if (rects[i].y + rects[i].h > c->height)
+			c->height = rects[i].y + rects[i].h;
+	}
+}
+
+void *pack_worker(void *arg)
+{
+	struct pack_search *search = arg;
+	struct stbrp_rect *rects =
+		malloc(sizeof(*rects) * (search->rect_count + 1));
+	struct stbrp_node *nodes = malloc(sizeof(*nodes) * search->max_dim);
+
+	for (;;) {
+		pthread_mutex_lock(&search->lock);
+		int i = search->next_candidate++;
+		pthread_mutex_unlock(&search->lock);
+
+		if (i >= search->candidate_count)
+			break;
+
+		memcpy(rects, search->rects,
+		       sizeof(*rects) * search->rect_count);
+		try_candidate(search->candidates + i, rects,
+			      search->rect_count, search->max_dim, nodes);
+	}
+
+	free(nodes);
+	free(rects);
+	return NULL;
+}
+
+// return 1 if candidate a makes a better atlas than b
+int is_better_candidate(const struct pack_candidate *a,
+			const struct pack_candidate *b)
+{
+	if (!a->width)
+		return 0;
+	if (!b->width)
+		return 1;
+
+	long a_area = (long)a->width * a->height;
+	long b_area = (long)b->width * b->height;
+	if (a_area != b_area)
+		return a_area < b_area;
+
+	// prefer the squarer of two equally sized atlases
+	int a_max = a->width > a->height ? a->width : a->height;
+	int b_max = b->width > b->height ? b->width : b->height;
+	return a_max < b_max;
+}
+
+/* Finds the smallest atlas that holds every rect and writes their positions
+ * into rects. Target widths run from a lower bound given by the widest rect
+ * and the total area up to twice the side of a square of that area, each
+ * tried with every skyline heuristic on thread_count threads. The smallest
+ * used area wins, ties are broken in favour of squarer atlases and then the
+ * earlier candidate so the result doesn't depend on the thread count.
+ * return 0 on success, -1 if the rects don't fit in max_dim x max_dim
+ */
+int pack_rects(struct stbrp_rect *rects, int rect_count, int max_dim,
+	       int thread_count, int *width, int *height)
+{
+	long area = 0;
+	int max_w = 1;
+	int max_h = 1;
+	for (int i = 0; i < rect_count; i++) {
+		area += (long)rects[i].w * rects[i].h;
+		if (rects[i].w > max_w)
+			max_w = rects[i].w;
+		if (rects[i].h > max_h)
+			max_h = rects[i].h;
+	}
+
+	long min_width = (area + max_dim - 1) / max_dim;
+	if (min_width < max_w)
+		min_width = max_w;
+	if (min_width > max_dim || max_h > max_dim)
+		return -1;
+
+	long max_width = (long)ceil(sqrt((double)area)) * 2;
+	if (max_width > max_dim)
+		max_width = max_dim;
+	if (max_width < min_width)
+		max_width = min_width;
+
+	struct pack_search search = { 0 };
+	search.rects = rects;
+	search.rect_count = rect_count;
+	search.max_dim = max_dim;
+	search.candidates = malloc(sizeof(*search.candidates) *
+				   PACK_WIDTH_STEPS * PACK_HEURISTIC_COUNT);
+
+	// geometric steps between the bounds, skipping repeats
+	int last_width = 0;
+	for (int s = 0; s < PACK_WIDTH_STEPS; s++) {
+		double t = (double)s / (PACK_WIDTH_STEPS - 1);
+		int target_width = (int)ceil(
+			min_width * pow((double)max_width / min_width, t));
+		if (target_width > max_width)
+			target_width = max_width;
+		if (target_width == last_width)
+			continue;
+		last_width = target_width;
+
+		for (int h = 0; h < PACK_HEURISTIC_COUNT; h++) {
+			struct pack_candidate *c =
+				search.candidates + search.candidate_count++;
+			c->target_width = target_width;
+			c->heuristic = pack_heuristics[h];
+		}
+	}
+
+	if (thread_count > search.candidate_count)
+		thread_count = search.candidate_count;
+
+	if (thread_count <= 1) {
+		pack_worker(&search);
+	} else {
+		// candidates the threads that couldn't be started leave are
+		// tried here
+		pthread_mutex_init(&search.lock, NULL);
+		pthread_t *threads = malloc(sizeof(*threads) * thread_count);
+		int started = 0;
+		for (int i = 0; threads && i < thread_count; i++) {
+			if (pthread_create(&threads[started], NULL,
+					   pack_worker, &search) == 0)
+				started++;
+		}
+		if (started < thread_count)
+			pack_worker(&search);
+		for (int i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+		free(threads);
+		pthread_mutex_destroy(&search.lock);
+	}
+
+	struct pack_candidate *best = search.candidates;
+	for (int i = 1; i < search.candidate_count; i++) {
+		if (is_better_candidate(search.candidates + i, best))
+			best = search.candidates + i;
+	}
+
+	// the range above can miss a square max_dim target that would fit,
+	// so that gets one last try before giving up
+	if (!best->width && last_width != max_dim) {
+		best->target_width = max_dim;
+		best->heuristic = STBRP_HEURISTIC_Skyline_BL_sortHeight;
+		struct stbrp_rect *copy = malloc(sizeof(*copy) * rect_count);
+		struct stbrp_node *nodes = malloc(sizeof(*nodes) * max_dim);
+		memcpy(copy, rects, sizeof(*copy) * rect_count);
+		try_candidate(best, copy, rect_count, max_dim, nodes);
+		free(nodes);
+		free(copy);
+	}
+
+	int result = -1;
+	if (best->width) {
+		// pack the winner once more, this time into the caller's rects
+		struct stbrp_node *nodes = malloc(sizeof(*nodes) * max_dim);
+		try_candidate(best, rects, rect_count, max_dim, nodes);
+		free(nodes);
+		*width = best->width;
+		*height = best->height;
+		result = 0;
+	}
+
+	free(search.candidates);
+	return result;
+}
+
+/* A set of bitmaps that should end up on the same atlas page, such as the
+ * members of one group. Its bitmaps are members[start] to
+ * members[start + count - 1].
+ */
+struct pack_unit {
+	int start, count;
+	int page;
+};
+
+// return 1 if every rect fits in a max_dim x max_dim page
+int rects_fit(struct stbrp_rect *rects, int rect_count, int max_dim,
+	      struct stbrp_node *nodes)
+{
+	struct stbrp_context ctx;
+
+	stbrp_init_target(&ctx, max_dim, max_dim, nodes, max_dim);
+	return stbrp_pack_rects(&ctx, rects, rect_count);
+}
+
+void set_rect_size(struct stbrp_rect *r, struct bitmap *bitmap, int pad)
+{
+	r->w = bitmap->width + pad * 2;
+	r->h = bitmap->height + pad * 2;
+}
+
+// used to sort bitmaps by unit while keeping their order within a unit
+struct unit_member {
+	int unit_id;
+	int index;
+};
+
+int compare_unit_members(const void *a, const void *b)
+{
+	const struct unit_member *ma = a;
+	const struct unit_member *mb = b;
+	if (ma->unit_id != mb->unit_id)
+		return ma->unit_id < mb->unit_id ? -1 : 1;
+	return ma->index - mb->index;
+}
+
+/* Assigns a page to every unit when the bitmaps don't fit on a single page.
+ * Pages are filled first fit, whole units at a time, so bitmaps of the same
+ * unit share a page whenever the unit fits on one. Each round adds the longest
+ * run of waiting units that still fits, found by an exponential search, and
+ * skips the unit that ended it. A page is done after PAGE_FILL_ROUNDS rounds,
+ * so filling it takes a bounded number of packing passes over about a page
+ * worth of units, however many units are left. A unit too large for an empty
+ * page is split up into single bitmaps.
+ * return page count on success, -1 if a bitmap is larger than a page
+ */
+int assign_pages(struct bitmap **bitmaps, int *members, struct pack_unit **units,
+		 int *unit_count, int max_dim, int pad)
+{
+	int rect_total = 0;
+	for (int u = 0; u < *unit_count; u++)
+		rect_total += (*units)[u].count;
+
+	struct stbrp_rect *rects = malloc(sizeof(*rects) * (rect_total + 1));
+	struct stbrp_node *nodes = malloc(sizeof(*nodes) * max_dim);
+	// units waiting for a page, and where the rects of each of them end
+	int *waiting = malloc(sizeof(*waiting) * (rect_total + 1));
+	int *ends = malloc(sizeof(*ends) * (rect_total + 2));
+	int page_count = 0;
+
+	for (;;) {
+		int waiting_count = 0;
+		for (int u = 0; u < *unit_count; u++) {
+			if ((*units)[u].page == -1)
+				waiting[waiting_count++] = u;
+		}
+		if (waiting_count == 0)
+			break;
+
+		int accepted = 0;
+		int next = 0;
+		for (int round = 0;
+		     round < PAGE_FILL_ROUNDS && next < waiting_count;
+		     round++) {
+			ends[0] = accepted;
+			for (int i = next; i < waiting_count; i++) {
+				struct pack_unit *unit = *units + waiting[i];
+				int r = ends[i - next];
+				for (int j = 0; j < unit->count; j++) {
+					int b = members[unit->start + j];
+					set_rect_size(&rects[r + j], bitmaps[b],
+						      pad);
+				}
+				ends[i - next + 1] = r + unit->count;
+			}
+
+			// probe runs of doubling length, then bisect the last
+			// step, so no probe packs much more than a page holds
+			int low = 0;
+			int high = waiting_count - next;
+			for (int step = 1; low < high; step *= 2) {
+				int probe = low + step;
+				if (probe > high)
+					probe = high;
+				if (!rects_fit(rects, ends[probe], max_dim, nodes)) {
+					high = probe - 1;
+					break;
+				}
+				low = probe;
+			}
+			while (low < high) {
+				int mid = (low + high + 1) / 2;
+				if (rects_fit(rects, ends[mid], max_dim, nodes))
+					low = mid;
+				else
+					high = mid - 1;
+			}
+
+			// the first unit doesn't even fit on an empty page
+			if (accepted == 0 && low == 0)
+				break;
+
+			for (int i = 0; i < low; i++)
+				(*units)[waiting[next + i]].page = page_count;
+			accepted = ends[low];
+			next += low + 1;
+		}
+
+		if (accepted > 0) {
+			page_count++;
+			continue;
+		}
+
+		// not even an empty page holds this unit, split it up
+		int first = waiting[0];
+		struct pack_unit big = (*units)[first];
+		if (big.count == 1) {
+			page_count = -1;
+			break;
+		}
+
+		*units = realloc(*units, sizeof(**units) *
+						 (*unit_count + big.count - 1));
+		memmove(*units + first + big.count, *units + first + 1,
+			sizeof(**units) * (*unit_count - first - 1));
+		for (int i = 0; i < big.count; i++) {
+			struct pack_unit *single = *units + first + i;
+			single->start = big.start + i;
+			single->count = 1;
+			single->page = -1;
+		}
+		*unit_count += big.count - 1;
+	}
+
+	free(ends);
+	free(waiting);
+	free(nodes);
+	free(rects);
+	return page_count;
+}
+
+/* Packs bitmaps into as few max_dim x max_dim pages as needed and allocates
+ * the pages, filled with the transparent index. Every bitmap is surrounded by
+ * pad pixels of free space. unit_ids gives every bitmap a
+ * unit number, bitmaps sharing one are kept on the same page where possible.
+ * Each page is then shrunk to the smallest size pack_rects finds for it. The
+ * bitmaps' pixels still need to be placed afterwards, by copy_bitmaps or by
+ * decoding them straight into the pages.
+ * return 0 on success, -1 if a bitmap doesn't fit on a page
+ */
+int pack_pages(struct bitmap **bitmaps, int bitmap_count, const int *unit_ids,
+	       int max_dim, int pad, int thread_count, struct atlas *atlas)
+{
+	struct stbrp_rect *rects = malloc(sizeof(*rects) * (bitmap_count + 1));
+	int *members = malloc(sizeof(*members) * (bitmap_count + 1));
+	int page_count = 1;
+
+	memset(atlas, 0, sizeof(*atlas));
+
+	for (int i = 0; i < bitmap_count; i++) {
+		set_rect_size(&rects[i], bitmaps[i], pad);
+		bitmaps[i]->page = 0;
+		members[i] = i;
+	}
+
+	int width, height;
+	int is_packed = pack_rects(rects, bitmap_count, max_dim, thread_count,
+				   &width, &height) == 0;
+	if (!is_packed) {
+		// group the bitmaps by unit, keeping their order within one
+		struct unit_member *sorted =
+			malloc(sizeof(*sorted) * (bitmap_count + 1));
+		for (int i = 0; i < bitmap_count; i++) {
+			sorted[i].unit_id = unit_ids[i];
+			sorted[i].index = i;
+		}
+		qsort(sorted, bitmap_count, sizeof(*sorted),
+		      compare_unit_members);
+
+		int unit_count = 0;
+		struct pack_unit *units =
+			malloc(sizeof(*units) * (bitmap_count + 1));
+		for (int i = 0; i < bitmap_count; i++) {
+			members[i] = sorted[i].index;
+			if (i == 0 || sorted[i].unit_id != sorted[i - 1].unit_id) {
+				units[unit_count].start = i;
+				units[unit_count].count = 0;
+				units[unit_count].page = -1;
+				unit_count++;
+			}
+			units[unit_count - 1].count++;
+		}
+		free(sorted);
+
+		page_count = assign_pages(bitmaps, members, &units, &unit_count,
+					  max_dim, pad);
+
+		for (int u = 0; u < unit_count && page_count > 0; u++) {
+			for (int i = 0; i < units[u].count; i++)
+				bitmaps[members[units[u].start + i]]->page =
+					units[u].page;
+		}
+		free(units);
+
+		if (page_count < 1) {
+			free(members);
+			free(rects);
+			return -1;
+		}
+	}
+
+	atlas->page_count = page_count;
+	atlas->pages = calloc(page_count, sizeof(*atlas->pages));
+
+	for (int p = 0; p < page_count; p++) {
+		int rect_count = 0;
+		for (int i = 0; i < bitmap_count; i++) {
+			if (bitmaps[i]->page != p)
+				continue;
+			members[rect_count] = i;
+			set_rect_size(&rects[rect_count], bitmaps[i], pad);
+			rect_count++;
+		}
+
+		// a single page was already packed by the first attempt,
+		// unless that failed and assign_pages found one page anyway
+		if (!is_packed &&
+		    pack_rects(rects, rect_count, max_dim, thread_count, &width,
+			       &height)) {
+			free(members);
+			free(rects);
+			free_atlas(atlas);
+			return -1;
+		}
+
+		for (int i = 0; i < rect_count; i++) {
+			struct bitmap *bm = bitmaps[members[i]];
+			bm->x_pos = rects[i].x + pad;
+			bm->y_pos = rects[i].y + pad;
+		}
+
+		struct bitmap *page = atlas->pages + p;
+		page->width = width;
+		page->height = height;
+		page->image_bytes = malloc((size_t)width * height);
+		memset(page->image_bytes, TRANSPARENT_INDEX,
+		       (size_t)width * height);
+	}
+
+	free(members);
+	free(rects);
+	return 0;
+}
+
+/* Returns the index of the first pixel in row that isn't TRANSPARENT_INDEX,
+ * or width if there is none. Compares 16 pixels at a time where SSE2 is
+ * available, 8 at a time otherwise.
+ */
+int first_opaque(const uint8_t *row, int width)
+{
+	int x = 0;
+
+#ifdef __SSE2__
+	const __m128i transparent = _mm_set1_epi8((char)TRANSPARENT_INDEX);
+	for (; x + 16 <= width; x += 16) {
+		__m128i pixels = _mm_loadu_si128((const __m128i *)(row + x));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(pixels, transparent));
+		if (mask != 0xFFFF)
+			return x + __builtin_ctz(~mask);
+	}
+#else
+	const uint64_t transparent = 0x0101010101010101ULL * TRANSPARENT_INDEX;
+	for (; x + 8 <= width; x += 8) {
+		uint64_t pixels;
+		memcpy(&pixels, row + x, sizeof(pixels));
+		if (pixels != transparent)
+			break;
+	}
+#endif
+
+	for (; x < width; x++) {
+		if (row[x] != TRANSPARENT_INDEX)
+			return x;
+	}
+	return width;
+}
+
+// returns the index of the last opaque pixel in row, or -1 if there is none
+int last_opaque(const uint8_t *row, int width)
+{
+	int x = width;
+
+#ifdef __SSE2__
+	const __m128i transparent = _mm_set1_epi8((char)TRANSPARENT_INDEX);
+	for (; x - 16 >= 0; x -= 16) {
+		__m128i pixels =
+			_mm_loadu_si128((const __m128i *)(row + x - 16));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(pixels, transparent));
+		if (mask != 0xFFFF)
+			return x - 16 + 31 - __builtin_clz(~mask & 0xFFFF);
+	}
+#else
+	const uint64_t transparent = 0x0101010101010101ULL * TRANSPARENT_INDEX;
+	for (; x - 8 >= 0; x -= 8) {
+		uint64_t pixels;
+		memcpy(&pixels, row + x - 8, sizeof(pixels));
+		if (pixels != transparent)
+			break;
+	}
+#endif
+
+	for (x--; x >= 0; x--) {
+		if (row[x] != TRANSPARENT_INDEX)
+			return x;
+	}
+	return -1;
+}
+
+/* Finds the tight bounds of the opaque pixels in an image whose rows are
+ * stride bytes apart. x1 and y1 are exclusive.
+ * return 0 on success, -1 if every pixel is transparent
+ */
+int find_opaque_bounds(const uint8_t *pixels, int width, int height,
+		       int stride, int *x0, int *y0, int *x1, int *y1)
+{
+	int top = 0;
+	while (top < height &&
+	       first_opaque(pixels + (size_t)top * stride, width) == width)
+		top++;
+
+	if (top == height)
+		return -1;
+
+	int bottom = height - 1;
+	while (first_opaque(pixels + (size_t)bottom * stride, width) == width)
+		bottom--;
+
+	int left = width;
+	int right = -1;
+	for (int y = top; y <= bottom; y++) {
+		const uint8_t *row = pixels + (size_t)y * stride;
+		// only the columns outside the bounds so far need checking
+		int first = first_opaque(row, left);
+		if (first < left)
+			left = first;
+		int last = last_opaque(row + right + 1, width - right - 1);
+		if (last != -1)
+			right += last + 1;
+	}
+
+	*x0 = left;
+	*y0 = top;
+	*x1 = right + 1;
+	*y1 = bottom + 1;
+	return 0;
+}
+
+/* Cuts a decoded bitmap down to the bounding box of its opaque pixels, moving
+ * the kept rows to the front of image_bytes. The trim deltas and original
+ * size are kept so the sprite can be placed as if it was never trimmed. A
+ * fully transparent bitmap ends up 0x0.
+ */
+void trim_bitmap(struct bitmap *bitmap)
+{
+	int x0, y0, x1, y1;
+
+	bitmap->is_trimmed = 1;
+	bitmap->source_width = bitmap->width;
+	bitmap->source_height = bitmap->height;
+
+	if (find_opaque_bounds(bitmap->image_bytes, bitmap->width,
+			       bitmap->height, bitmap->width, &x0, &y0, &x1,
+			       &y1)) {
+		bitmap->trim_x = 0;
+		bitmap->trim_y = 0;
+		bitmap->width = 0;
+		bitmap->height = 0;
+		return;
+	}
+
+	int width = x1 - x0;
+	int height = y1 - y0;
+	for (int y = 0; y < height; y++) {
+		memmove(bitmap->image_bytes + (size_t)y * width,
+			bitmap->image_bytes +
+				(size_t)(y + y0) * bitmap->width + x0,
+			width);
+	}
+
+	bitmap->trim_x = x0;
+	bitmap->trim_y = y0;
+	bitmap->width = width;
+	bitmap->height = height;
+}
+
+// FNV-1a over a bitmap's dimensions and pixels
+uint64_t hash_bitmap(const struct bitmap *bitmap)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int32_t dims[2] = { bitmap->width, bitmap->height };
+	const uint8_t *bytes = (const uint8_t *)dims;
+
+	for (size_t i = 0; i < sizeof(dims); i++)
+		hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+
+	size_t size = (size_t)bitmap->width * bitmap->height;
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ bitmap->image_bytes[i]) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+// used to sort bitmaps by hash while keeping their order within equal hashes
+struct hashed_bitmap {
+	uint64_t hash;
+	int index;
+};
+
+int compare_hashed_bitmaps(const void *a, const void *b)
+{
+	const struct hashed_bitmap *ha = a;
+	const struct hashed_bitmap *hb = b;
+	if (ha->hash != hb->hash)
+		return ha->hash < hb->hash ? -1 : 1;
+	return ha->index - hb->index;
+}
+
+int same_pixels(const struct bitmap *a, const struct bitmap *b)
+{
+	return a->width == b->width && a->height == b->height &&
+	       memcmp(a->image_bytes, b->image_bytes,
+		      (size_t)a->width * a->height) == 0;
+}
+
+/* Points duplicate_of of every bitmap whose pixels match an earlier bitmap at
+ * that earlier bitmap, so only the first copy is packed and every copy
+ * shares its rectangle. Offsets and hotspots stay per bitmap, only the image
+ * is shared. Bitmaps must be decoded.
+ * return number of duplicates found
+ */
+int find_duplicate_bitmaps(struct bitmap **bitmaps, int bitmap_count)
+{
+	struct hashed_bitmap *hashed =
+		malloc(sizeof(*hashed) * (bitmap_count + 1));
+	int duplicate_count = 0;
+
+	for (int i = 0; i < bitmap_count; i++) {
+		hashed[i].hash = hash_bitmap(bitmaps[i]);
+		hashed[i].index = i;
+		bitmaps[i]->duplicate_of = NULL;
+	}
+
+	qsort(hashed, bitmap_count, sizeof(*hashed), compare_hashed_bitmaps);
+
+	for (int run = 0; run < bitmap_count;) {
+		int end = run + 1;
+		while (end < bitmap_count && hashed[end].hash == hashed[run].hash)
+			end++;
+
+		// within a run of equal hashes, compare against every earlier
+		// original to rule out collisions
+		for (int i = run + 1; i < end; i++) {
+			struct bitmap *bm = bitmaps[hashed[i].index];
+			for (int j = run; j < i; j++) {
+				struct bitmap *other = bitmaps[hashed[j].index];
+				if (!other->duplicate_of &&
+				    same_pixels(bm, other)) {
+					bm->duplicate_of = other;
+					duplicate_count++;
+					break;
+				}
+			}
+		}
+
+		run = end;
+	}
+
+	free(hashed);
+	return duplicate_count;
+}
+
+// gives every duplicate the page and position of the bitmap it copies
+void place_duplicate_bitmaps(struct bitmap **bitmaps, int bitmap_count)
+{
+	for (int i = 0; i < bitmap_count; i++) {
+		struct bitmap *original = bitmaps[i]->duplicate_of;
+		if (!original)
+			continue;
+		bitmaps[i]->page = original->page;
+		bitmaps[i]->x_pos = original->x_pos;
+		bitmaps[i]->y_pos = original->y_pos;
+	}
+}
+
+/* Packs the bitmaps of bgf_count bgfs into shared atlas pages, with every
+ * group as a unit so that animations stay on one page. Bitmaps no group refers
+ * to get a unit of their own. Duplicates found by find_duplicate_bitmaps
+ * aren't packed, they reuse the rectangle of their original, which may belong
+ * to another bgf.
+ * return 0 on success, -1 on error
+ */
+int pack_bgfs(struct bgf *bgfs, int bgf_count, struct atlas *atlas,
+	      int max_dim, int pad, int thread_count)
+{
+	int bitmap_count = 0;
+	for (int b = 0; b < bgf_count; b++)
+		bitmap_count += bgfs[b].bitmap_count;
+
+	struct bitmap **bitmaps =
+		malloc(sizeof(*bitmaps) * (bitmap_count + 1));
+	int *unit_ids = calloc(bitmap_count + 1, sizeof(*unit_ids));
+	int *bgf_unit_ids = NULL;
+
+	// unit ids of each bgf start after the ids every earlier bgf can use
+	int unique_count = 0;
+	int first_unit = 0;
+	for (int b = 0; b < bgf_count; b++) {
+		struct bgf *bgf = bgfs + b;
+
+		bgf_unit_ids = realloc(bgf_unit_ids, sizeof(*bgf_unit_ids) *
+							     (bgf->bitmap_count + 1));
+		for (int i = 0; i < bgf->bitmap_count; i++)
+			bgf_unit_ids[i] = -1;
+
+		int indexes_offset = 0;
+		for (int g = 0; g < bgf->group_count; g++) {
+			for (int j = 0; j < bgf->bitmap_groups[g]; j++) {
+				uint32_t index =
+					bgf->bitmap_indexes[indexes_offset + j];
+				if (index < bgf->bitmap_count &&
+				    bgf_unit_ids[index] == -1)
+					bgf_unit_ids[index] = first_unit + g;
+			}
+			indexes_offset += bgf->bitmap_groups[g];
+		}
+
+		for (int i = 0; i < bgf->bitmap_count; i++) {
+			if (bgf->bitmaps[i].duplicate_of)
+				continue;
+			bitmaps[unique_count] = bgf->bitmaps + i;
+			unit_ids[unique_count] =
+				bgf_unit_ids[i] == -1 ?
+					first_unit + (int)bgf->group_count + i :
+					bgf_unit_ids[i];
+			unique_count++;
+		}
+
+		first_unit += bgf->group_count + bgf->bitmap_count;
+	}
+
+	int result = pack_pages(bitmaps, unique_count, unit_ids, max_dim, pad,
+				thread_count, atlas);
+
+	if (result == 0) {
+		int i = 0;
+		for (int b = 0; b < bgf_count; b++) {
+			for (int j = 0; j < bgfs[b].bitmap_count; j++)
+				bitmaps[i++] = bgfs[b].bitmaps + j;
+		}
+		place_duplicate_bitmaps(bitmaps, bitmap_count);
+	}
+
+	free(bgf_unit_ids);
+	free(unit_ids);
+	free(bitmaps);
+	return result;
+}
+
+// packs the bitmaps of a single bgf, return 0 on success, -1 on error
+int pack_bitmaps(struct bgf *bgf, struct atlas *atlas, int max_dim, int pad,
+		 int thread_count)
+{
+	return pack_bgfs(bgf, 1, atlas, max_dim, pad, thread_count);
+}
+
+void free_atlas(struct atlas *atlas)
+{
+	for (int p = 0; p < atlas->page_count; p++)
+		free(atlas->pages[p].image_bytes);
+	free(atlas->pages);
+	memset(atlas, 0, sizeof(*atlas));
+}
+
+// copies every decoded bitmap to its packed position in its page
+void copy_bitmaps(struct bgf *bgf, struct atlas *atlas)
+{
+	for (int i = 0; i < bgf->bitmap_count; i++) {
+		struct bitmap *bm = &bgf->bitmaps[i];
+		struct bitmap *b = atlas->pages + bm->page;
+
+		if (bm->duplicate_of)
+			continue;
+
+		int x = bm->x_pos;
+		int y = bm->y_pos;
+		int w = bm->width;
+		int h = bm->height;
+
+		uint8_t *bp = bm->image_bytes;
+		uint8_t *ap = b->image_bytes;
+		for (int r = 0; r < h; r++) {
+			uint8_t *src = &bp[r * w];
+			uint8_t *dst = &ap[x + (y + r) * b->width];
+			memcpy(dst, src, w);
+		}
+	}
+}
+
+/* Fills the gutter of gutter pixels around a placed bitmap by repeating its
+ * edge pixels outwards, corners take the corner pixel. Filtered or mipmapped
+ * sampling near the edge then picks up the sprite's own colors instead of
+ * transparency or a neighbouring sprite.
+ */
+void extrude_bitmap(struct bitmap *page, const struct bitmap *bm, int gutter)
+{
+	int x = bm->x_pos;
+	int y = bm->y_pos;
+	int w = bm->width;
+	int h = bm->height;
+
+	if (w == 0 || h == 0 || gutter == 0)
+		return;
+
+	for (int r = 0; r < h; r++) {
+		uint8_t *row = page->image_bytes + (size_t)(y + r) * page->width;
+		memset(row + x - gutter, row[x], gutter);
+		memset(row + x + w, row[x + w - 1], gutter);
+	}
+
+	uint8_t *top = page->image_bytes + (size_t)y * page->width + x - gutter;
+	uint8_t *bottom =
+		page->image_bytes + (size_t)(y + h - 1) * page->width + x - gutter;
+	for (int r = 1; r <= gutter; r++) {
+		memcpy(top - (size_t)r * page->width, top, w + gutter * 2);
+		memcpy(bottom + (size_t)r * page->width, bottom, w + gutter * 2);
+	}
+}
+
+// extrudes the edges of every packed bitmap of a bgf into its gutter
+void extrude_bitmaps(struct bgf *bgf, struct atlas *atlas, int gutter)
+{
+	for (int i = 0; i < bgf->bitmap_count; i++) {
+		struct bitmap *bm = &bgf->bitmaps[i];
+		if (!bm->duplicate_of)
+			extrude_bitmap(atlas->pages + bm->page, bm, gutter);
+	}
+}
@@ -0,0 +1,43 @@
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include "bgf.h"
+#include "stb_rect_pack.h"
+
+// CONSTANTS
+// transparent border around every packed bitmap, unless a gutter is asked for
+#define ATLAS_PAD 1
+#define ATLAS_MAX_DIM 4096
+
+// one or more pages of packed bitmaps, each page image is a struct bitmap
+struct atlas {
+	int page_count;
+	struct bitmap *pages;
+};
+
+// return 0 on success, -1 if the rects don't fit in max_dim x max_dim
+int pack_rects(struct stbrp_rect *rects, int rect_count, int max_dim,
+	       int thread_count, int *width, int *height);
+// return 0 on success, -1 if a bitmap doesn't fit on a page
+int pack_pages(struct bitmap **bitmaps, int bitmap_count, const int *unit_ids,
+	       int max_dim, int pad, int thread_count, struct atlas *atlas);
+// return 0 on success, -1 if every pixel is transparent
+int find_opaque_bounds(const uint8_t *pixels, int width, int height,
+		       int stride, int *x0, int *y0, int *x1, int *y1);
+void trim_bitmap(struct bitmap *bitmap);
+uint64_t hash_bitmap(const struct bitmap *bitmap);
+// return number of duplicates found
+int find_duplicate_bitmaps(struct bitmap **bitmaps, int bitmap_count);
+void place_duplicate_bitmaps(struct bitmap **bitmaps, int bitmap_count);
+// return 0 on success, -1 on error
+int pack_bgfs(struct bgf *bgfs, int bgf_count, struct atlas *atlas,
+	      int max_dim, int pad, int thread_count);
+// return 0 on success, -1 on error
+int pack_bitmaps(struct bgf *bgf, struct atlas *atlas, int max_dim, int pad,
+		 int thread_count);
+void free_atlas(struct atlas *atlas);
+void copy_bitmaps(struct bgf *bgf, struct atlas *atlas);
+void extrude_bitmap(struct bitmap *page, const struct bitmap *bm, int gutter);
+void extrude_bitmaps(struct bgf *bgf, struct atlas *atlas, int gutter);
+
+#endif
@@ -0,0 +1,499 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "zlib.h"
+#include "bgf.h"
+
+static const char *const bgf_error_messages[BGF_ERROR_COUNT] = {
+	"success",
+	"failed to open file",
+	"failed to read file",
+	"unexpected end of file",
+	"not a bgf file",
+	"unsupported bgf version",
+	"bad bitmap dimensions",
+	"bad group size",
+	"failed to uncompress bitmap image data",
+	"frame index out of range",
+	"out of memory",
+};
+
+const char *bgf_strerror(int error)
+{
+	if (error < 0 || error >= BGF_ERROR_COUNT)
+		return "unknown error";
+	return bgf_error_messages[error];
+}
+
+// records why a call on bgf failed, return -1 to pass on to the caller
+static int set_bgf_error(struct bgf *bgf, int error)
+{
+	bgf->error = error;
+	return -1;
+}
+
+/* Maps the whole file into memory so the parser can walk it without a stdio
+ * call per field. Falls back to reading the file into a heap buffer when it
+ * can't be mapped (e.g. pipes).
+ * return 0 on success, -1 on error
+ */
+int open_bgf(struct bgf *bgf, const char *file_name)
+{
+	struct stat st;
+
+	memset(bgf, 0, sizeof(*bgf));
+	bgf->file_name = file_name;
+
+	int fd = open(file_name, O_RDONLY);
+
+	if (fd == -1 || fstat(fd, &st)) {
+		bgf->os_error = errno;
+		if (fd != -1)
+			close(fd);
+		return set_bgf_error(bgf, BGF_ERROR_OPEN);
+	}
+
+	bgf->size = st.st_size;
+
+	if (bgf->size > 0) {
+		void *map = mmap(NULL, bgf->size, PROT_READ, MAP_PRIVATE, fd,
+				 0);
+		if (map != MAP_FAILED) {
+			bgf->data = map;
+			bgf->is_mapped = 1;
+			close(fd);
+			return 0;
+		}
+	}
+
+	uint8_t *buffer = malloc(bgf->size ? bgf->size : 1);
+	if (!buffer) {
+		close(fd);
+		return set_bgf_error(bgf, BGF_ERROR_MEMORY);
+	}
+
+	size_t total = 0;
+	while (total < bgf->size) {
+		ssize_t n = read(fd, buffer + total, bgf->size - total);
+		if (n <= 0) {
+			bgf->os_error = n < 0 ? errno : 0;
+			free(buffer);
+			close(fd);
+			return set_bgf_error(bgf, BGF_ERROR_READ);
+		}
+		total += n;
+	}
+
+	close(fd);
+	bgf->data = buffer;
+	return 0;
+}
+
+/* Parses a bgf that is already in memory, such as one read out of an archive.
+ * The data isn't copied and must outlive the bgf, name is only kept for the
+ * caller's error messages.
+ */
+void bgf_open_memory(struct bgf *bgf, const uint8_t *data, size_t size,
+		     const char *name)
+{
+	memset(bgf, 0, sizeof(*bgf));
+	bgf->file_name = name;
+	bgf->data = data;
+	bgf->size = size;
+	bgf->is_borrowed = 1;
+}
+
+// frees all necessary variables and unmaps the file
+void free_bgf(struct bgf *bgf)
+{
+	if (bgf->is_mapped)
+		munmap((void *)bgf->data, bgf->size);
+	else if (bgf->data && !bgf->is_borrowed)
+		free((void *)bgf->data);
+
+	if (bgf->bitmaps) {
+		for (int i = 0; i < bgf->bitmap_count; i++) {
+			if (bgf->bitmaps[i].hotspots)
+				free(bgf->bitmaps[i].hotspots);
+			if (bgf->bitmaps[i].image_bytes)
+				free(bgf->bitmaps[i].image_bytes);
+		}
+		free(bgf->bitmaps);
+	}
+
+	if (bgf->bitmap_groups)
+		free(bgf->bitmap_groups);
+
+	if (bgf->bitmap_indexes)
+		free(bgf->bitmap_indexes);
+
+	memset(bgf, 0, sizeof(*bgf));
+}
+
+// checks that byte_count more bytes can be read from the file
+// return 0 on success, -1 on error
+static int check_bgf_bytes(struct bgf *bgf, size_t byte_count)
+{
+	if (byte_count > bgf->size - bgf->pos)
+		return set_bgf_error(bgf, BGF_ERROR_TRUNCATED);
+
+	return 0;
+}
+
+// loads byte_count number of bytes into dest address
+// return 0 on success, -1 on error
+static int load_bgf_bytes(struct bgf *bgf, void *dest, size_t byte_count)
+{
+	if (check_bgf_bytes(bgf, byte_count))
+		return -1;
+
+	memcpy(dest, bgf->data + bgf->pos, byte_count);
+	bgf->pos += byte_count;
+	return 0;
+}
+
+// return 0 on success, -1 on error
+static int load_bitmap(struct bgf *bgf, struct bitmap *bitmap)
+{
+	bitmap->x_pos = 0;
+	bitmap->y_pos = 0;
+
+	// load header information
+	if (load_bgf_bytes(bgf, &bitmap->width, sizeof(bitmap->width)) ||
+	    load_bgf_bytes(bgf, &bitmap->height, sizeof(bitmap->height)) ||
+	    load_bgf_bytes(bgf, &bitmap->x_offset, sizeof(bitmap->x_offset)) ||
+	    load_bgf_bytes(bgf, &bitmap->y_offset, sizeof(bitmap->y_offset)) ||
+	    load_bgf_bytes(bgf, &bitmap->hotspot_count,
+			   sizeof(bitmap->hotspot_count)))
+		return -1;
+
+	// compressed frames don't say how large they inflate, so this is all
+	// that keeps a corrupt header from a huge allocation
+	if (bitmap->width < 0 || bitmap->height < 0 ||
+	    bitmap->width > BGF_MAX_DIMENSION ||
+	    bitmap->height > BGF_MAX_DIMENSION ||
+	    (size_t)bitmap->width * bitmap->height > BGF_MAX_PIXELS)
+		return set_bgf_error(bgf, BGF_ERROR_DIMENSIONS);
+
+	bitmap->hotspots = malloc(sizeof(*bitmap->hotspots) *
+				  (bitmap->hotspot_count + 1));
+	if (!bitmap->hotspots)
+		return set_bgf_error(bgf, BGF_ERROR_MEMORY);
+
+	// load hotspots
+	for (int j = 0; j < bitmap->hotspot_count; ++j) {
+		struct hotspot *hotspot = bitmap->hotspots + j;
+		if (load_bgf_bytes(bgf, &hotspot->number,
+				   sizeof(hotspot->number)) ||
+		    load_bgf_bytes(bgf, &hotspot->x, sizeof(hotspot->x)) ||
+		    load_bgf_bytes(bgf, &hotspot->y, sizeof(hotspot->y)))
+			return -1;
+	}
+
+	// load the image bytes
+	if (load_bgf_bytes(bgf, &bitmap->format, sizeof(bitmap->format)) ||
+	    load_bgf_bytes(bgf, &bitmap->compressed_size,
+			   sizeof(bitmap->compressed_size)))
+		return -1;
+
+	// only record where the pixels are, decode_bgf inflates them later
+	size_t payload_size = bitmap->format == COMPRESSED ?
+				      bitmap->compressed_size :
+				      (size_t)bitmap->width * bitmap->height;
+	if (check_bgf_bytes(bgf, payload_size))
+		return -1;
+	bitmap->data_offset = bgf->pos;
+	bgf->pos += payload_size;
+
+	return 0;
+}
+
+/* Inflates (or copies) the pixels of a single bitmap out of the mapping into
+ * dest, whose rows are stride bytes apart. zlib's streaming API is fed one row
+ * at a time so the pixels can land directly inside a larger image such as an
+ * atlas. Only reads shared state, so bitmaps can be decoded from several
+ * threads at once; the only way it fails is BGF_ERROR_INFLATE, which callers
+ * record themselves.
+ * return 0 on success, -1 on error
+ */
+int decode_bitmap_into(struct bgf *bgf, struct bitmap *bitmap, uint8_t *dest,
+		       int stride)
+{
+	const uint8_t *source = bgf->data + bitmap->data_offset;
+
+	if (bitmap->format != COMPRESSED) {
+		for (int r = 0; r < bitmap->height; r++)
+			memcpy(dest + (size_t)r * stride,
+			       source + (size_t)r * bitmap->width,
+			       bitmap->width);
+		return 0;
+	}
+
+	// inflate straight out of the mapping, no staging copy needed
+	z_stream stream = { 0 };
+	stream.next_in = (Bytef *)source;
+	stream.avail_in = bitmap->compressed_size;
+
+	if (inflateInit(&stream) != Z_OK)
+		return -1;
+
+	int result = Z_OK;
+	for (int r = 0; r < bitmap->height && result == Z_OK; r++) {
+		stream.next_out = dest + (size_t)r * stride;
+		stream.avail_out = bitmap->width;
+		while (stream.avail_out > 0 && result == Z_OK)
+			result = inflate(&stream, Z_NO_FLUSH);
+		if (result == Z_STREAM_END && (stream.avail_out > 0 ||
+					       r != bitmap->height - 1))
+			result = Z_DATA_ERROR;
+	}
+
+	inflateEnd(&stream);
+
+	// zero sized bitmaps never call inflate, everything else must have
+	// consumed exactly width * height bytes
+	if (result != Z_OK && result != Z_STREAM_END)
+		return -1;
+
+	return 0;
+}
+
+/* Decodes frame index of a loaded bgf into a caller owned buffer of at least
+ * height rows, stride bytes apart. Can be called from several threads at once
+ * for the same bgf, so the cause of a failure is returned rather than left in
+ * bgf->error, which is never written.
+ * return BGF_OK on success, a BGF_ERROR_ code on error
+ */
+int bgf_decode_frame(struct bgf *bgf, int index, uint8_t *dest, int stride)
+{
+	if (index < 0 || index >= bgf->bitmap_count)
+		return BGF_ERROR_FRAME;
+
+	if (decode_bitmap_into(bgf, bgf->bitmaps + index, dest, stride))
+		return BGF_ERROR_INFLATE;
+
+	return BGF_OK;
+}
+
+// decodes a bitmap into its own image_bytes buffer, return a BGF_ERROR_ code
+static int decode_own_bitmap(struct bgf *bgf, struct bitmap *bitmap)
+{
+	size_t size = (size_t)bitmap->width * bitmap->height;
+
+	bitmap->image_bytes = malloc(size ? size : 1);
+	if (!bitmap->image_bytes)
+		return BGF_ERROR_MEMORY;
+	if (decode_bitmap_into(bgf, bitmap, bitmap->image_bytes,
+			       bitmap->width))
+		return BGF_ERROR_INFLATE;
+	return BGF_OK;
+}
+
+// decodes a bitmap into its own image_bytes buffer
+// return 0 on success, -1 on error
+int decode_bitmap(struct bgf *bgf, struct bitmap *bitmap)
+{
+	int error = decode_own_bitmap(bgf, bitmap);
+
+	return error ? set_bgf_error(bgf, error) : 0;
+}
+
+/* Shared between decode threads, each one claims the next undecoded bitmap.
+ * When pages is set, bitmaps are decoded straight into their packed position
+ * on their atlas page instead of their own buffers.
+ */
+struct decode_queue {
+	struct bgf *bgf;
+	struct bitmap *pages;
+	int next_bitmap;
+	// BGF_ERROR_ code of a failed bitmap, BGF_OK while none failed
+	int error;
+	pthread_mutex_t lock;
+};
+
+// return a BGF_ERROR_ code
+static int decode_queued_bitmap(struct decode_queue *queue, int i)
+{
+	struct bitmap *bitmap = queue->bgf->bitmaps + i;
+
+	if (!queue->pages)
+		return decode_own_bitmap(queue->bgf, bitmap);
+
+	struct bitmap *page = queue->pages + bitmap->page;
+	uint8_t *dest = page->image_bytes + (size_t)bitmap->y_pos * page->width +
+			bitmap->x_pos;
+	if (decode_bitmap_into(queue->bgf, bitmap, dest, page->width))
+		return BGF_ERROR_INFLATE;
+	return BGF_OK;
+}
+
+static void *decode_worker(void *arg)
+{
+	struct decode_queue *queue = arg;
+	struct bgf *bgf = queue->bgf;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		int i = queue->next_bitmap++;
+		pthread_mutex_unlock(&queue->lock);
+
+		if (i >= bgf->bitmap_count)
+			break;
+
+		int error = decode_queued_bitmap(queue, i);
+		if (error) {
+			pthread_mutex_lock(&queue->lock);
+			queue->error = error;
+			pthread_mutex_unlock(&queue->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/* Second phase of loading: inflates every bitmap recorded by load_bgf, spread
+ * across thread_count threads. With atlas pages, every bitmap is written to
+ * its x_pos/y_pos on its page and image_bytes is left empty, otherwise each
+ * bitmap gets its own image_bytes.
+ * return 0 on success, -1 on error
+ */
+int decode_bgf_into(struct bgf *bgf, struct bitmap *pages, int thread_count)
+{
+	struct decode_queue queue = { 0 };
+	queue.bgf = bgf;
+	queue.pages = pages;
+
+	if (thread_count > bgf->bitmap_count)
+		thread_count = bgf->bitmap_count;
+
+	pthread_t *threads = NULL;
+	if (thread_count > 1)
+		threads = malloc(sizeof(*threads) * thread_count);
+
+	if (!threads) {
+		for (int i = 0; i < bgf->bitmap_count; i++) {
+			int error = decode_queued_bitmap(&queue, i);
+			if (error)
+				return set_bgf_error(bgf, error);
+		}
+		return 0;
+	}
+
+	// whatever the threads that couldn't be started leave is decoded here
+	pthread_mutex_init(&queue.lock, NULL);
+	int started = 0;
+	for (int i = 0; i < thread_count; i++) {
+		if (pthread_create(&threads[started], NULL, decode_worker,
+				   &queue) == 0)
+			started++;
+	}
+	if (started < thread_count)
+		decode_worker(&queue);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&queue.lock);
+
+	return queue.error ? set_bgf_error(bgf, queue.error) : 0;
+}
+
+int decode_bgf(struct bgf *bgf, int thread_count)
+{
+	return decode_bgf_into(bgf, NULL, thread_count);
+}
+
+/* First phase of loading: parses the header, every bitmap header and the
+ * groups, recording where each bitmap's pixels sit in the file without
+ * inflating them.
+ * return 0 on success, -1 on error
+ */
+int load_bgf(struct bgf *bgf)
+{
+	// load bgf header information
+	int magic[4] = { 0x42, 0x47, 0x46, 0x11 };
+	uint8_t byte;
+	for (int i = 0; i < 4; i++) {
+		if (load_bgf_bytes(bgf, &byte, 1))
+			return -1;
+		if (byte != magic[i])
+			return set_bgf_error(bgf, BGF_ERROR_MAGIC);
+	}
+
+	if (load_bgf_bytes(bgf, &bgf->version, sizeof(bgf->version)))
+		return -1;
+
+	if (bgf->version != BGF_VERSION)
+		return set_bgf_error(bgf, BGF_ERROR_VERSION);
+
+	if (load_bgf_bytes(bgf, bgf->bitmap_name, sizeof(bgf->bitmap_name)) ||
+	    load_bgf_bytes(bgf, &bgf->bitmap_count,
+			   sizeof(bgf->bitmap_count)) ||
+	    load_bgf_bytes(bgf, &bgf->group_count, sizeof(bgf->group_count)) ||
+	    load_bgf_bytes(bgf, &bgf->max_group_bitmaps,
+			   sizeof(bgf->max_group_bitmaps)) ||
+	    load_bgf_bytes(bgf, &bgf->shrink_factor,
+			   sizeof(bgf->shrink_factor)))
+		return -1;
+
+	// every bitmap header takes at least 22 bytes, reject absurd counts
+	// before allocating for them
+	if (check_bgf_bytes(bgf, (size_t)bgf->bitmap_count * 22))
+		return -1;
+
+	// calloc to ensure pointers are 0 (for cleanup check)
+	bgf->bitmaps = calloc(bgf->bitmap_count + 1, sizeof(*bgf->bitmaps));
+	if (!bgf->bitmaps)
+		return set_bgf_error(bgf, BGF_ERROR_MEMORY);
+
+	// start loading bitmaps
+	for (int i = 0; i < bgf->bitmap_count; i++) {
+		if (load_bitmap(bgf, bgf->bitmaps + i))
+			return -1;
+	}
+
+	if (check_bgf_bytes(bgf, (size_t)bgf->group_count * 4))
+		return -1;
+
+	// every index read takes 4 bytes of the file, which bounds how many
+	// there are whatever max_group_bitmaps claims
+	size_t index_capacity =
+		(size_t)bgf->max_group_bitmaps * bgf->group_count;
+	if (index_capacity > (bgf->size - bgf->pos) / 4)
+		index_capacity = (bgf->size - bgf->pos) / 4;
+
+	bgf->bitmap_groups =
+		malloc(sizeof(*bgf->bitmap_groups) * (bgf->group_count + 1));
+	bgf->bitmap_indexes =
+		malloc(sizeof(*bgf->bitmap_indexes) * (index_capacity + 1));
+	if (!bgf->bitmap_groups || !bgf->bitmap_indexes)
+		return set_bgf_error(bgf, BGF_ERROR_MEMORY);
+
+	size_t indexes_offset = 0;
+	for (int i = 0; i < bgf->group_count; i++) {
+		if (load_bgf_bytes(bgf, bgf->bitmap_groups + i,
+				   sizeof(*bgf->bitmap_groups)))
+			return -1;
+		uint32_t index_count = bgf->bitmap_groups[i];
+
+		if (index_count > bgf->max_group_bitmaps)
+			return set_bgf_error(bgf, BGF_ERROR_GROUP);
+
+		for (int j = 0; j < index_count; ++j) {
+			if (load_bgf_bytes(bgf,
+					   bgf->bitmap_indexes +
+						   indexes_offset + j,
+					   sizeof(*bgf->bitmap_indexes)))
+				return -1;
+		}
+
+		indexes_offset += index_count;
+	}
+
+	return 0;
+}
@@ -0,0 +1,113 @@
+#ifndef BGF_H
+#define BGF_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+// CONSTANTS
+#define COMPRESSED 1
+#define TRANSPARENT_INDEX 254
+#define BGF_VERSION 10
+
+// ERROR CODES, left in struct bgf's error by a call that returns -1
+#define BGF_OK 0
+// the file couldn't be opened or read, os_error holds the errno
+#define BGF_ERROR_OPEN 1
+#define BGF_ERROR_READ 2
+#define BGF_ERROR_TRUNCATED 3
+#define BGF_ERROR_MAGIC 4
+#define BGF_ERROR_VERSION 5
+#define BGF_ERROR_DIMENSIONS 6
+#define BGF_ERROR_GROUP 7
+#define BGF_ERROR_INFLATE 8
+#define BGF_ERROR_FRAME 9
+#define BGF_ERROR_MEMORY 10
+#define BGF_ERROR_COUNT 11
+
+// largest frame accepted, anything bigger is taken as a corrupt header
+#define BGF_MAX_DIMENSION 16384
+#define BGF_MAX_PIXELS (64 * 1024 * 1024)
+
+// STRUCTS FOR INDIVIDUAL IMAGES IN BGF
+struct hotspot {
+	int8_t number;
+	int32_t x, y;
+};
+
+struct bitmap {
+	// position inside the atlas and which atlas page it is on
+	int x_pos, y_pos;
+	int page;
+	int32_t width, height;
+	int32_t x_offset, y_offset;
+	/* set by trim_bitmap: the pixels were cut down to their opaque bounds,
+	 * which start trim_x, trim_y into the source_width x source_height
+	 * image stored in the bgf
+	 */
+	int is_trimmed;
+	int32_t trim_x, trim_y;
+	int32_t source_width, source_height;
+	uint8_t hotspot_count;
+	struct hotspot *hotspots;
+	uint8_t format;
+	uint32_t compressed_size;
+	// where the (possibly compressed) pixels start in the file
+	size_t data_offset;
+	uint8_t *image_bytes;
+	// set when the pixels match an earlier bitmap, which is packed instead
+	struct bitmap *duplicate_of;
+};
+
+/* Everything loaded from a single bgf file, one per conversion. The whole file
+ * is mapped into memory by open_bgf (or handed over by bgf_open_memory) and
+ * parsed in place, data and size describe that memory and pos is the read
+ * cursor into it. Nothing is shared between bgfs, so separate bgfs can be
+ * used from separate threads, and the library never prints: failed calls
+ * leave a BGF_ERROR_ code in error for the caller to report, except for
+ * bgf_decode_frame, which returns it.
+ */
+struct bgf {
+	const char *file_name;
+	const uint8_t *data;
+	size_t size;
+	size_t pos;
+	int is_mapped;
+	// data belongs to the caller of bgf_open_memory
+	int is_borrowed;
+	int error;
+	int os_error;
+	uint32_t version;
+	char bitmap_name[32];
+	uint32_t bitmap_count;
+	uint32_t group_count;
+	uint32_t max_group_bitmaps;
+	uint32_t shrink_factor;
+	struct bitmap *bitmaps;
+	uint32_t *bitmap_groups;
+	uint32_t *bitmap_indexes;
+};
+
+// return a description of a BGF_ERROR_ code
+const char *bgf_strerror(int error);
+// return 0 on success, -1 on error
+int open_bgf(struct bgf *bgf, const char *file_name);
+void bgf_open_memory(struct bgf *bgf, const uint8_t *data, size_t size,
+		     const char *name);
+// parses headers only, return 0 on success, -1 on error
+int load_bgf(struct bgf *bgf);
+// return 0 on success, -1 on error
+int decode_bitmap_into(struct bgf *bgf, struct bitmap *bitmap, uint8_t *dest,
+		       int stride);
+// decodes a bitmap into its own image_bytes, return 0 on success, -1 on error
+int decode_bitmap(struct bgf *bgf, struct bitmap *bitmap);
+/* decodes frame index into dest, safe to call from several threads at once
+ * return BGF_OK on success, a BGF_ERROR_ code on error
+ */
+int bgf_decode_frame(struct bgf *bgf, int index, uint8_t *dest, int stride);
+// inflates every bitmap, return 0 on success, -1 on error
+int decode_bgf_into(struct bgf *bgf, struct bitmap *pages, int thread_count);
+// inflates every bitmap, return 0 on success, -1 on error
+int decode_bgf(struct bgf *bgf, int thread_count);
+void free_bgf(struct bgf *bgf);
+
+#endif
@@ -2,544 +2,1569 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
-#include <setjmp.h>
-#include <libgen.h>
-#include "zlib.h"
-#include "png.h"
-
-#define STB_RECT_PACK_IMPLEMENTATION
-#include "stb_rect_pack.h"
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bgf.h"
+#include "atlas.h"
+#include "store.h"
+#include "cache.h"
+#include "stats.h"
+#include "metadata.h"
+#include "hitmask.h"
+#include "sdf.h"
+#include "delta.h"
+#include "png_out.h"
+#include "dds.h"
 
 // CONSTANTS
-#define COMPRESSED 1
-#define TRANSPARENT_INDEX 254
-#define BGF_VERSION 10
-
-#define ATLAS_PAD 1
-#define ATLAS_MAX_DIM 4096
-
-// BGF VARIABLES TO BE FILLED
-uint32_t version = 0;
-char bitmap_name[32] = { 0 };
-uint32_t bitmap_count = 0;
-uint32_t group_count = 0;
-uint32_t max_group_bitmaps = 0;
-uint32_t shrink_factor = 1;
-struct bitmap *bitmaps = NULL;
-uint32_t *bitmap_groups = NULL;
-uint32_t *bitmap_indexes = NULL;
-FILE *bgf_file = NULL;
-
-// MERIDIAN 59 COLOR PALETTE
-static uint32_t hex_palette[256] = {
-	0x000000, 0x800000, 0x008000, 0x808000, 0x000080, 0x800080, 0x008080,
-	0xC0C0C0, 0x800000, 0x008000, 0x800000, 0x008000, 0x800000, 0x008000,
-	0x800000, 0x008000, 0xC20101, 0xB40101, 0xAB0202, 0xA60101, 0x9A0202,
-	0x910200, 0x890200, 0x7F0000, 0x780200, 0x6D0100, 0x560000, 0x4C0000,
-	0x400000, 0x380000, 0x260000, 0x110000, 0xFEC294, 0xEBB892, 0xDBA983,
-	0xCB9D7C, 0xC69475, 0xB58769, 0xB18866, 0xA88060, 0x9D7356, 0x916B51,
-	0x886048, 0x7A5844, 0x755440, 0x684D3B, 0x604631, 0x4A3B2D, 0xFFB580,
-	0xF3A872, 0xDC9968, 0xCA8D61, 0xC48257, 0xB97A51, 0xAB7347, 0xA56E44,
-	0x935C36, 0x855231, 0x7B4626, 0x6B3D22, 0x63381C, 0x552F18, 0x4B280D,
-	0x321C0B, 0xB95F2B, 0x91461A, 0x833F18, 0x793B16, 0x773412, 0x722F10,
-	0x69300C, 0x662D0C, 0x5E250C, 0x54220C, 0x4B1B0B, 0x41190B, 0x3C170B,
-	0x33140B, 0x2A140B, 0x1B0F0A, 0xFFB233, 0xFFA91B, 0xFFA511, 0xFA9C00,
-	0xEE9400, 0xD88700, 0xCC7F00, 0xC27900, 0xAA6A00, 0xA06400, 0x885500,
-	0x7E4F00, 0x684100, 0x5C3900, 0x442A00, 0x301E00, 0x89B174, 0x82A96E,
-	0x78A164, 0x70955C, 0x678B53, 0x5F814C, 0x587C49, 0x507042, 0x476537,
-	0x3E5A31, 0x304F26, 0x29441F, 0x253E16, 0x1C3010, 0x101E08, 0x070E03,
-	0x00C432, 0x00B82F, 0x00AA2B, 0x009E27, 0x009A27, 0x008C24, 0x008A23,
-	0x007E20, 0x00721D, 0x006219, 0x005014, 0x004511, 0x003E10, 0x00300C,
-	0x001A07, 0x000E04, 0xABD5DE, 0xA5CED7, 0x89BCC5, 0x7FACB3, 0x709AA3,
-	0x6A919A, 0x4E8189, 0x48757D, 0x345F67, 0x2E555D, 0x1B464E, 0x173D46,
-	0x0A343D, 0x062930, 0x031B21, 0x00090B, 0x344EDE, 0x324AD3, 0x2B3EC7,
-	0x2A3ABC, 0x2434AB, 0x2230A1, 0x1B2C92, 0x172684, 0x0A1B78, 0x08186B,
-	0x021256, 0x010F4B, 0x000A46, 0x00073B, 0x000329, 0x000018, 0xA042C2,
-	0x993FB9, 0x9438B2, 0x862EA2, 0x7A2CA1, 0x6E2893, 0x66248B, 0x5E2081,
-	0x56186F, 0x4E1263, 0x3F0355, 0x36004C, 0x2D003E, 0x21002F, 0x170020,
-	0x0A0010, 0xF4F0CE, 0xEDE7B0, 0xEBE4A3, 0xE5DC89, 0xD8D7F6, 0xBBBAF0,
-	0xAFADED, 0x9491E7, 0x9CE99C, 0x84E484, 0x5AD75A, 0x28B828, 0xF2C5C5,
-	0xE89898, 0xE17777, 0xDC6262, 0xFFEA6E, 0xFADE37, 0xF7D51B, 0xF0D019,
-	0xEECA1A, 0xDEBD19, 0xDCC413, 0xCFB910, 0xC5B40A, 0xB9A708, 0x9A8902,
-	0x877A00, 0x807300, 0x777100, 0x706A00, 0x555100, 0xE7E7E7, 0xD5D5D5,
-	0xCDCDCD, 0xBCBCBC, 0xB4B4B4, 0xA3A3A3, 0x9A9A9A, 0x929292, 0x818181,
-	0x787878, 0x676767, 0x5F5F5F, 0x4E4E4E, 0x464646, 0x343434, 0x242424,
-	0x7CBFFF, 0x67ABEF, 0x5FA3E7, 0x5F9AD5, 0x4E89C5, 0x4678AB, 0x3D70A3,
-	0x3C6B9A, 0x345F89, 0x2C5277, 0x1B4167, 0x112F4D, 0x0A243D, 0x05182B,
-	0x010E1B, 0x000B16, 0xE0B494, 0xD0B084, 0xCCA87C, 0xC4A074, 0x800000,
-	0x008000, 0x800000, 0x008000, 0x808080, 0xFF0000, 0x00FF00, 0xFFFF00,
-	0x0000FF, 0xFF00FF, 0x000000, 0xFFFFFF
+// bump whenever outputs change for the same input, so caches are redone
+#define BGF2PNG_VERSION "1.20"
+
+// settings shared by every conversion in a run, read only once parsed
+struct convert_options {
+	const char *out_dir;
+	int verbose;
+	// threads each conversion may use for its own frames and packing
+	int file_threads;
+	// inflate frames straight into the atlas instead of their own buffers
+	int direct_decode;
+	// largest width and height of an atlas page
+	int max_dim;
+	// pack pixel identical bitmaps only once
+	int dedup;
+	// pack only the opaque bounds of every bitmap
+	int trim;
+	// free space around every packed bitmap, extruded when gutter is set
+	int pad;
+	int gutter;
+	// pack every input into one shared atlas with this name instead
+	const char *atlas_name;
+	// only index the headers of every input into this catalog instead
+	const char *scan_name;
+	// write every frame to this content addressed store instead of an atlas
+	struct store *store;
+	// skip inputs whose outputs in this manifest are up to date
+	struct cache *cache;
+	// totals of the run, when they are reported
+	struct stats *stats;
+	// one of the PNG_PRESET_ speed and size trade offs
+	int png_preset;
+	// dds.format is one of the DDS_ formats, or -1 to write png files
+	struct dds_options dds;
+	// write a 1 bit opacity mask of every frame next to the json
+	int hitmask;
+	// distance in pixels covered by a distance field next to every page, or
+	// 0 to write none
+	int sdf_spread;
+	// write every frame again, delta encoded along its groups
+	int delta;
 };
 
-// STRUCTS FOR INDIVIDUAL IMAGES IN BGF
-struct hotspot {
-	int8_t number;
-	int32_t x, y;
+/* Shared state for batch conversion. Worker threads pull the next input off
+ * the list until it is exhausted, so large and small files balance out across
+ * the pool without any up front partitioning.
+ */
+struct job_queue {
+	char **file_names;
+	int file_count;
+	int next_file;
+	int failed_count;
+	struct convert_options options;
+	// handles the file at index, return 0 on success, -1 on error
+	int (*run_job)(struct job_queue *queue, int index);
+	// one per file when building a shared atlas or a catalog
+	struct bgf *bgfs;
+	pthread_mutex_t lock;
 };
 
-struct bitmap {
-	int x_pos, y_pos;
-	int32_t width, height;
-	int32_t x_offset, y_offset;
-	uint8_t hotspot_count;
-	struct hotspot *hotspots;
-	uint8_t format;
-	uint32_t compressed_size;
-	uint8_t *image_bytes;
-};
+char *change_ext(const char *filename, const char *new_ext)
+{
+	const char *dot = strrchr(filename, '.');
+	size_t base_len;
 
-// frees all necessary variables and files
-void cleanup()
+	if (dot) {
+		base_len = dot - filename;
+	} else {
+		base_len = strlen(filename);
+	}
+
+	// add 2 for null terminator and "."
+	char *out = malloc(sizeof(char) * (base_len + strlen(new_ext) + 2));
+	sprintf(out, "%.*s.%s", (int)base_len, filename, new_ext);
+	return out;
+}
+
+// returns <filename without extension>_<page>.<ext>
+char *page_file_name(const char *filename, int page, const char *ext)
 {
-	if (bgf_file)
-		fclose(bgf_file);
-
-	if (bitmaps) {
-		for (int i = 0; i < bitmap_count; i++) {
-			if (bitmaps[i].hotspots)
-				free(bitmaps[i].hotspots);
-			if (bitmaps[i].image_bytes)
-				free(bitmaps[i].image_bytes);
-		}
-		free(bitmaps);
+	const char *dot = strrchr(filename, '.');
+	size_t base_len;
+
+	if (dot) {
+		base_len = dot - filename;
+	} else {
+		base_len = strlen(filename);
 	}
 
-	if (bitmap_groups)
-		free(bitmap_groups);
+	// add 14 for "_", the page number, "." and null terminator
+	char *out = malloc(sizeof(char) * (base_len + strlen(ext) + 14));
+	sprintf(out, "%.*s_%d.%s", (int)base_len, filename, page, ext);
+	return out;
+}
+
+char *cat_dir_base(const char *dir, const char *base)
+{
+	// add 2 for null terminator and "/"
+	char *out = malloc(sizeof(char) * (strlen(dir) + strlen(base) + 2));
+	sprintf(out, "%s/%s", dir, base);
+	return out;
+}
 
-	if (bitmap_indexes)
-		free(bitmap_indexes);
+// returns the file extension of the images written with options
+const char *image_ext(const struct convert_options *options)
+{
+	return options->dds.format == -1 ? "png" : "dds";
 }
 
-// loads byte_count number of bytes into dest address
-// return 0 on success, exits program on error
-int load_bgf_bytes(void *dest, size_t byte_count)
+/* Writes the end of the store names of images written with options. Every
+ * dds format shares the extension, so dds names also carry the format and
+ * the options that change the file.
+ */
+void store_suffix(const struct convert_options *options,
+		  char suffix[STORE_SUFFIX_LEN])
 {
-	int items_read = fread(dest, byte_count, 1, bgf_file);
+	int format = options->dds.format;
 
-	if (items_read < 1) {
-		fprintf(stderr, "Fatal Error: Failed to read from bgf file\n");
-		cleanup();
-		exit(EXIT_FAILURE);
+	if (format == -1) {
+		snprintf(suffix, STORE_SUFFIX_LEN, ".png");
+		return;
 	}
 
-	return 0;
+	snprintf(suffix, STORE_SUFFIX_LEN, "_%s%s%s.dds",
+		 dds_format_names[format],
+		 format == DDS_RGBA && options->dds.premultiply ? "_pm" : "",
+		 options->dds.mipmaps ? "_mip" : "");
 }
 
-void load_bitmap(struct bitmap *bitmap)
+/* Returns the rects of the sprites packed on an atlas page, each with its
+ * gutter, so mip levels are filtered within a sprite and never across two.
+ */
+struct mip_rect *find_page_rects(struct bgf *bgfs, int bgf_count, int page,
+				 int pad, int *rect_count)
 {
-	bitmap->x_pos = 0;
-	bitmap->y_pos = 0;
-
-	// load header information
-	load_bgf_bytes(&bitmap->width, sizeof(bitmap->width));
-	load_bgf_bytes(&bitmap->height, sizeof(bitmap->height));
-	load_bgf_bytes(&bitmap->x_offset, sizeof(bitmap->x_offset));
-	load_bgf_bytes(&bitmap->y_offset, sizeof(bitmap->y_offset));
-	load_bgf_bytes(&bitmap->hotspot_count, sizeof(bitmap->hotspot_count));
-
-	bitmap->hotspots =
-		malloc(sizeof(*bitmap->hotspots) * bitmap->hotspot_count);
-
-	// load hotspots
-	for (int j = 0; j < bitmap->hotspot_count; ++j) {
-		struct hotspot *hotspot = bitmap->hotspots + j;
-		load_bgf_bytes(&hotspot->number, sizeof(hotspot->number));
-		load_bgf_bytes(&hotspot->x, sizeof(hotspot->x));
-		load_bgf_bytes(&hotspot->y, sizeof(hotspot->y));
-	}
-
-	// load the image bytes
-	load_bgf_bytes(&bitmap->format, sizeof(bitmap->format));
-	load_bgf_bytes(&bitmap->compressed_size,
-		       sizeof(bitmap->compressed_size));
-
-	unsigned long uncomp_size = bitmap->width * bitmap->height;
-	bitmap->image_bytes = malloc(uncomp_size);
-
-	if (bitmap->format == COMPRESSED) {
-		uint8_t *source = malloc(bitmap->compressed_size);
-		load_bgf_bytes(source, bitmap->compressed_size);
-		int result = uncompress(bitmap->image_bytes, &uncomp_size,
-					source, bitmap->compressed_size);
-		free(source);
-		if (result != Z_OK) {
-			fprintf(stderr,
-				"Error: Failed to uncompress bitmap image data\n");
-			cleanup();
-			exit(EXIT_FAILURE);
+	int count = 0;
+	for (int b = 0; b < bgf_count; b++)
+		count += bgfs[b].bitmap_count;
+
+	struct mip_rect *rects = malloc(sizeof(*rects) * (count + 1));
+	*rect_count = 0;
+	for (int b = 0; b < bgf_count; b++) {
+		for (int i = 0; i < bgfs[b].bitmap_count; i++) {
+			struct bitmap *bm = bgfs[b].bitmaps + i;
+			if (bm->duplicate_of || bm->page != page)
+				continue;
+			struct mip_rect *rect = rects + (*rect_count)++;
+			rect->x = bm->x_pos - pad;
+			rect->y = bm->y_pos - pad;
+			rect->width = bm->width + 2 * pad;
+			rect->height = bm->height + 2 * pad;
 		}
-	} else {
-		load_bgf_bytes(bitmap->image_bytes, uncomp_size);
 	}
+
+	return rects;
 }
 
-void load_bgf()
+/* Writes a png or dds image, rects are the sprites on it when it is an atlas
+ * page, or NULL.
+ * return 0 on success, -1 on error
+ */
+int write_image(const char *file_name, const struct bitmap *bitmap,
+		const struct mip_rect *rects, int rect_count,
+		const struct convert_options *options, int thread_count)
 {
-	printf("Loading BGF header...\n");
-
-	// load bgf header information
-	int magic[4] = { 0x42, 0x47, 0x46, 0x11 };
-	uint8_t byte;
-	for (int i = 0; i < 4; i++) {
-		load_bgf_bytes(&byte, 1);
-		if (byte != magic[i]) {
-			fprintf(stderr, "Error: Invalid BGF\n");
-			cleanup();
-			exit(EXIT_FAILURE);
-		}
+	if (options->dds.format == -1)
+		return write_png(file_name, bitmap, options->png_preset,
+				 thread_count);
+	return write_dds(file_name, bitmap, &options->dds, rects, rect_count,
+			 thread_count);
+}
+
+// returns <image name without extension>_sdf.<ext>
+char *sdf_file_name(const char *image_name)
+{
+	const char *dot = strrchr(image_name, '.');
+	size_t base_len = dot ? dot - image_name : strlen(image_name);
+	const char *ext = dot ? dot + 1 : "";
+
+	// add 6 for "_sdf", "." and null terminator
+	char *out = malloc(sizeof(char) * (base_len + strlen(ext) + 6));
+	sprintf(out, "%.*s_sdf.%s", (int)base_len, image_name, ext);
+	return out;
+}
+
+/* Writes the distance field of an image with the same layout, as a grayscale
+ * png or an r8 dds.
+ * return 0 on success, -1 on error
+ */
+int write_sdf(const char *file_name, const struct bitmap *bitmap,
+	      const struct mip_rect *rects, int rect_count,
+	      const struct convert_options *options, int thread_count)
+{
+	struct dds_options r8 = { DDS_R8, 0, 0 };
+	struct bitmap sdf;
+	int result;
+
+	build_sdf(bitmap, rects, rect_count, options->pad, options->sdf_spread,
+		  thread_count, &sdf);
+	if (options->dds.format == -1)
+		result = write_gray_png(file_name, &sdf);
+	else
+		result = write_dds(file_name, &sdf, &r8, NULL, 0, 1);
+	free(sdf.image_bytes);
+	return result;
+}
+
+// return 0 on success, -1 on error
+int write_deltas(const char *file_name, const uint8_t *deltas, size_t size)
+{
+	FILE *fp = fopen(file_name, "wb");
+
+	if (!fp) {
+		fprintf(stderr, "Error: Failed to create deltas %s: %s\n",
+			file_name, strerror(errno));
+		return -1;
 	}
 
-	load_bgf_bytes(&version, sizeof(version));
+	size_t written = fwrite(deltas, 1, size, fp);
 
-	if (version != BGF_VERSION) {
-		fprintf(stderr, "Error: Bad BGF version\n");
-		cleanup();
-		exit(EXIT_FAILURE);
+	if (fclose(fp) || written != size) {
+		fprintf(stderr, "Error: Failed to write deltas %s\n",
+			file_name);
+		return -1;
 	}
 
-	load_bgf_bytes(bitmap_name, sizeof(bitmap_name));
-	load_bgf_bytes(&bitmap_count, sizeof(bitmap_count));
-	load_bgf_bytes(&group_count, sizeof(group_count));
-	load_bgf_bytes(&max_group_bitmaps, sizeof(max_group_bitmaps));
-	load_bgf_bytes(&shrink_factor, sizeof(shrink_factor));
+	return 0;
+}
 
-	// calloc to ensure pointers are 0 (for cleanup check)
-	bitmaps = calloc(bitmap_count, sizeof(*bitmaps));
+/* Returns "<path>.<pid>.<n>.tmp", to write path under before renaming it in
+ * place. n counts up with every call, so conversions running on several
+ * threads of one process never write the same temporary file.
+ */
+char *temp_file_name(const char *path)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	static unsigned temp_count;
+	size_t len = strlen(path) + 48;
+	char *temp_name = malloc(len);
+
+	pthread_mutex_lock(&lock);
+	unsigned n = temp_count++;
+	pthread_mutex_unlock(&lock);
 
-	printf("Loading bitmaps...\n");
+	snprintf(temp_name, len, "%s.%ld.%u.tmp", path, (long)getpid(), n);
+	return temp_name;
+}
 
-	// start loading bitmaps
-	for (int i = 0; i < bitmap_count; i++) {
-		load_bitmap(bitmaps + i);
+/* Renames the temporary files of a conversion into place once all of them
+ * were written, result being 0, or removes them all if one failed. Readers
+ * never see a partly written output, and a failed conversion leaves the
+ * previous outputs in place.
+ * return 0 on success, -1 on error
+ */
+int replace_outputs(char **temp_paths, char **paths, int count, int result)
+{
+	for (int i = 0; i < count; i++) {
+		if (result == 0 && rename(temp_paths[i], paths[i])) {
+			fprintf(stderr, "Error: Failed to create %s: %s\n",
+				paths[i], strerror(errno));
+			result = -1;
+		}
+		if (result)
+			remove(temp_paths[i]);
 	}
 
-	printf("Loading groups and indexes...\n");
+	return result;
+}
 
-	bitmap_groups = malloc(sizeof(*bitmap_groups) * group_count);
-	bitmap_indexes = malloc(sizeof(*bitmap_indexes) * max_group_bitmaps *
-				group_count);
+/* Writes every frame of a decoded bgf to the store, unless an identical frame
+ * is there already, and returns the name of each frame's image in names.
+ * Images are written under a temporary name and renamed into place, so other
+ * processes sharing the store never see a partial file.
+ * return 0 on success, -1 on error
+ */
+int store_frames(struct bgf *bgf, const struct convert_options *options,
+		 char **names, struct stats *stats)
+{
+	struct store *store = options->store;
+	char suffix[STORE_SUFFIX_LEN];
+
+	store_suffix(options, suffix);
+	for (int i = 0; i < bgf->bitmap_count; i++) {
+		struct store_key key;
+
+		names[i] = malloc(STORE_NAME_LEN);
+		if (!claim_bitmap(store, bgf->bitmaps + i, suffix, &key,
+				  names[i]))
+			continue;
+
+		char *path = cat_dir_base(store->dir, names[i]);
+		char *temp_path = temp_file_name(path);
+
+		// a frame trimmed to nothing is stored as one transparent pixel
+		struct bitmap image = bgf->bitmaps[i];
+		uint8_t pixel = TRANSPARENT_INDEX;
+		if (image.width == 0 || image.height == 0) {
+			image.width = 1;
+			image.height = 1;
+			image.image_bytes = &pixel;
+		}
 
-	int indexes_offset = 0;
-	for (int i = 0; i < group_count; i++) {
-		load_bgf_bytes(bitmap_groups + i, sizeof(*bitmap_groups));
-		uint32_t index_count = bitmap_groups[i];
+		int result = write_image(temp_path, &image, NULL, 0, options, 1);
+		stats->image_bytes += file_size(temp_path);
+		result = replace_outputs(&temp_path, &path, 1, result);
+		finish_bitmap(store, &key, result);
 
-		for (int j = 0; j < index_count; ++j) {
-			load_bgf_bytes(bitmap_indexes + indexes_offset + j,
-				       sizeof(*bitmap_indexes));
+		free(temp_path);
+		free(path);
+		if (result) {
+			for (int j = i + 1; j < bgf->bitmap_count; j++)
+				names[j] = NULL;
+			return -1;
 		}
-
-		indexes_offset += index_count;
 	}
+
+	return 0;
 }
 
-// return 0 on success, -1 on error
-int write_png(char *file_name, struct bitmap *bitmap)
+int compare_strings(const void *a, const void *b)
 {
-	FILE *fp;
-	png_structp png_ptr;
-	png_infop info_ptr;
-	png_color palette[256];
-	png_byte trans_alpha[256];
-
-	fp = fopen(file_name, "wb");
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-	if (!fp) {
-		fprintf(stderr, "Error: Failed to create png %s: %s\n",
-			file_name, strerror(errno));
-		return -1;
+/* Records the outputs of a conversion in the cache: its own files and every
+ * store image its json refers to, each once, so is_cached also notices store
+ * images that went missing.
+ */
+void cache_store_outputs(struct cache *cache, const char *file_name,
+			 const struct cache_key *key, char **paths,
+			 int path_count, const char *store_dir, char **names,
+			 int name_count)
+{
+	char **sorted = malloc(sizeof(*sorted) * (name_count + 1));
+	char **outputs = malloc(sizeof(*outputs) * (path_count + name_count));
+	int output_count = 0;
+
+	memcpy(sorted, names, sizeof(*sorted) * name_count);
+	qsort(sorted, name_count, sizeof(*sorted), compare_strings);
+
+	for (int i = 0; i < path_count; i++)
+		outputs[output_count++] = paths[i];
+	for (int i = 0; i < name_count; i++) {
+		if (i == 0 || strcmp(sorted[i], sorted[i - 1]) != 0)
+			outputs[output_count++] =
+				cat_dir_base(store_dir, sorted[i]);
 	}
 
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
-					  NULL);
+	update_cache(cache, file_name, key, outputs, output_count);
+
+	for (int i = path_count; i < output_count; i++)
+		free(outputs[i]);
+	free(outputs);
+	free(sorted);
+}
 
-	if (!png_ptr) {
-		fprintf(stderr, "Error: Failed to initialize libpng struct\n");
-		fclose(fp);
+// prints why the last call on bgf failed
+void print_bgf_error(const struct bgf *bgf)
+{
+	if (bgf->os_error)
+		fprintf(stderr, "Error: %s: %s: %s\n", bgf->file_name,
+			bgf_strerror(bgf->error), strerror(bgf->os_error));
+	else
+		fprintf(stderr, "Error: %s: %s\n", bgf->file_name,
+			bgf_strerror(bgf->error));
+}
+
+/* Converts a single bgf file into a png atlas and json metadata file, written
+ * to out_dir (or the working directory if out_dir is NULL). Only touches its
+ * own struct bgf, so several conversions can run at once on different threads.
+ * Inputs the cache has up to date outputs for are skipped before decoding.
+ * return 0 on success, -1 on error
+ */
+int convert_bgf(const char *file_name, const struct convert_options *options)
+{
+	struct bgf bgf;
+	int verbose = options->verbose;
+	const char *out_dir = options->out_dir;
+	struct stats stats = { 0 };
+	double start = now_seconds();
+
+	// map bgf file
+	if (open_bgf(&bgf, file_name)) {
+		print_bgf_error(&bgf);
 		return -1;
 	}
 
-	info_ptr = png_create_info_struct(png_ptr);
+	struct cache_key key = { 0 };
+	if (options->cache) {
+		make_cache_key(bgf.data, bgf.size, &key);
+		if (is_cached(options->cache, file_name, &key)) {
+			printf("%s is unchanged, skipped\n", file_name);
+			free_bgf(&bgf);
+			return 0;
+		}
+	}
 
-	if (!info_ptr) {
-		png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
-		fprintf(stderr,
-			"Error: Failed to initialize libpng info struct\n");
-		fclose(fp);
+	printf("Unpacking %s\n", file_name);
+
+	if (verbose)
+		printf("Loading BGF headers, bitmap headers and groups...\n");
+	if (load_bgf(&bgf)) {
+		print_bgf_error(&bgf);
+		free_bgf(&bgf);
 		return -1;
 	}
 
-	if (setjmp(png_jmpbuf(png_ptr))) {
-		png_destroy_write_struct(&png_ptr, &info_ptr);
-		fclose(fp);
+	if (bgf.bitmap_count < 1) {
+		fprintf(stderr, "Error: %s contains no bitmaps\n", file_name);
+		free_bgf(&bgf);
 		return -1;
 	}
+	count_bgf(&stats, &bgf);
+	end_phase(&stats, STATS_LOAD, &start);
+
+	// the layout only needs the headers, so with direct decoding the
+	// atlas is packed first and every frame is inflated into its place
+	int direct = options->direct_decode && bgf.bitmap_count > 1;
+
+	if (!direct) {
+		if (verbose)
+			printf("Decompressing bitmaps...\n");
+		if (decode_bgf(&bgf, options->file_threads)) {
+			print_bgf_error(&bgf);
+			free_bgf(&bgf);
+			return -1;
+		}
+		count_inflated(&stats, &bgf);
+		end_phase(&stats, STATS_DECODE, &start);
+	}
 
-	png_init_io(png_ptr, fp);
+	// deltas are taken between whole frames, before they are trimmed
+	uint8_t *deltas = NULL;
+	size_t delta_size = 0;
+	if (options->delta) {
+		if (verbose)
+			printf("Delta encoding animation groups...\n");
+		if (encode_deltas(&bgf, &deltas, &delta_size)) {
+			fprintf(stderr, "Error: Failed to delta encode %s\n",
+				file_name);
+			free_bgf(&bgf);
+			return -1;
+		}
+		end_phase(&stats, STATS_ENCODE, &start);
+	}
 
-	png_set_IHDR(png_ptr, info_ptr, bitmap->width, bitmap->height, 8,
-		     PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
-		     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	if (options->trim && (bgf.bitmap_count > 1 || options->store)) {
+		if (verbose)
+			printf("Trimming transparent borders...\n");
+		for (int i = 0; i < bgf.bitmap_count; i++)
+			trim_bitmap(bgf.bitmaps + i);
+		end_phase(&stats, STATS_PACK, &start);
+	}
 
-	for (int i = 0; i < 256; i++) {
-		palette[i].red = (hex_palette[i] & 0xFF0000) >> 16;
-		palette[i].green = (hex_palette[i] & 0x00FF00) >> 8;
-		palette[i].blue = hex_palette[i] & 0x0000FF;
-		trans_alpha[i] = 255;
+	if (options->store) {
+		if (verbose)
+			printf("Storing bitmaps in %s...\n", options->store->dir);
+		char **names = calloc(bgf.bitmap_count, sizeof(char *));
+		// the json, the hit mask and the deltas, written under
+		// temporary names
+		int output_count = 1 + options->hitmask + options->delta;
+		char *paths[3];
+		char *temp_paths[3];
+		for (int i = 0; i < output_count; i++) {
+			const char *ext = i == 0		 ? "json" :
+					  i == 1 && options->hitmask ? "hit" :
+								       "bgd";
+			char *name = change_ext(path_base(file_name), ext);
+			paths[i] = out_dir ? cat_dir_base(out_dir, name) :
+					     strdup(name);
+			temp_paths[i] = temp_file_name(paths[i]);
+			free(name);
+		}
+
+		int result = store_frames(&bgf, options, names, &stats);
+		end_phase(&stats, STATS_ENCODE, &start);
+		if (result == 0)
+			result = export_store_metadata(&bgf, temp_paths[0],
+						       options->store->dir,
+						       names);
+		if (result == 0 && options->hitmask)
+			result = export_hitmask(&bgf, NULL, temp_paths[1]);
+		if (result == 0 && options->delta)
+			result = write_deltas(temp_paths[output_count - 1],
+					      deltas, delta_size);
+		for (int i = 0; i < output_count; i++)
+			stats.metadata_bytes += file_size(temp_paths[i]);
+		end_phase(&stats, STATS_METADATA, &start);
+		result = replace_outputs(temp_paths, paths, output_count,
+					 result);
+		if (result == 0 && options->cache)
+			cache_store_outputs(options->cache, file_name, &key,
+					    paths, output_count,
+					    options->store->dir, names,
+					    bgf.bitmap_count);
+
+		for (int i = 0; i < output_count; i++) {
+			free(paths[i]);
+			free(temp_paths[i]);
+		}
+		for (int i = 0; i < bgf.bitmap_count; i++)
+			free(names[i]);
+		free(names);
+		free(deltas);
+		free_bgf(&bgf);
+
+		if (result == 0 && options->stats)
+			merge_stats(options->stats, &stats);
+		if (result == 0)
+			printf("%s successfully unpacked\n", file_name);
+		return result;
 	}
 
-	trans_alpha[TRANSPARENT_INDEX] = 0;
+	if (options->dedup && bgf.bitmap_count > 1) {
+		struct bitmap **bitmaps =
+			malloc(sizeof(*bitmaps) * bgf.bitmap_count);
+		for (int i = 0; i < bgf.bitmap_count; i++)
+			bitmaps[i] = bgf.bitmaps + i;
+		int duplicate_count =
+			find_duplicate_bitmaps(bitmaps, bgf.bitmap_count);
+		free(bitmaps);
+		if (verbose)
+			printf("Found %d duplicate bitmaps...\n",
+			       duplicate_count);
+	}
+
+	struct atlas atlas = { 0 };
+	if (bgf.bitmap_count > 1) {
+		if (verbose)
+			printf("Converting bitmaps to PNG atlas...\n");
+		if (pack_bitmaps(&bgf, &atlas, options->max_dim, options->pad,
+				 options->file_threads) == -1) {
+			fprintf(stderr,
+				"Error: Failed to pack bitmaps of %s, a bitmap is larger than %dx%d\n",
+				file_name, options->max_dim, options->max_dim);
+			free(deltas);
+			free_bgf(&bgf);
+			return -1;
+		}
+
+		if (!direct) {
+			copy_bitmaps(&bgf, &atlas);
+		} else {
+			end_phase(&stats, STATS_PACK, &start);
+			if (verbose)
+				printf("Decompressing bitmaps into atlas...\n");
+			if (decode_bgf_into(&bgf, atlas.pages,
+					    options->file_threads)) {
+				print_bgf_error(&bgf);
+				free_atlas(&atlas);
+				free(deltas);
+				free_bgf(&bgf);
+				return -1;
+			}
+			count_inflated(&stats, &bgf);
+			end_phase(&stats, STATS_DECODE, &start);
+		}
+
+		if (options->gutter)
+			extrude_bitmaps(&bgf, &atlas, options->gutter);
+		count_atlas(&stats, &bgf, 1, &atlas);
+	} else {
+		if (verbose)
+			printf("Converting bitmap to PNG...\n");
+		// the lone bitmap is the image, hand its pixels to the atlas
+		atlas.page_count = 1;
+		atlas.pages = calloc(1, sizeof(*atlas.pages));
+		atlas.pages[0] = bgf.bitmaps[0];
+		bgf.bitmaps[0].image_bytes = NULL;
+	}
+	end_phase(&stats, STATS_PACK, &start);
+
+	// a single page keeps the plain <name>.png, more are <name>_<page>.png,
+	// or .dds
+	int page_count = atlas.page_count;
+	char **png_names = malloc(sizeof(char *) * page_count);
+	for (int p = 0; p < page_count; p++) {
+		if (page_count == 1)
+			png_names[p] = change_ext(path_base(file_name),
+						  image_ext(options));
+		else
+			png_names[p] = page_file_name(path_base(file_name), p,
+						      image_ext(options));
+	}
 
-	png_set_tRNS(png_ptr, info_ptr, trans_alpha, 256, NULL);
+	// the pages, the json, the hit mask, the distance field of every page
+	// and the deltas, all written under temporary names
+	int sdf_first = page_count + 1 + options->hitmask;
+	int delta_index = sdf_first + (options->sdf_spread ? page_count : 0);
+	int output_count = delta_index + options->delta;
+	char **paths = malloc(sizeof(char *) * output_count);
+	char **temp_paths = malloc(sizeof(char *) * output_count);
+	for (int i = 0; i < output_count; i++) {
+		char *name;
+		if (i < page_count)
+			name = strdup(png_names[i]);
+		else if (i == page_count)
+			name = change_ext(path_base(file_name), "json");
+		else if (i < sdf_first)
+			name = change_ext(path_base(file_name), "hit");
+		else if (i < delta_index)
+			name = sdf_file_name(png_names[i - sdf_first]);
+		else
+			name = change_ext(path_base(file_name), "bgd");
+		paths[i] = out_dir ? cat_dir_base(out_dir, name) : strdup(name);
+		temp_paths[i] = temp_file_name(paths[i]);
+		free(name);
+	}
 
-	png_set_PLTE(png_ptr, info_ptr, palette, 256);
+	int result = 0;
+	for (int p = 0; p < page_count && result == 0; p++) {
+		// a lone bitmap is one image, packed pages hold many
+		int rect_count = 0;
+		struct mip_rect *rects = NULL;
+		if (bgf.bitmap_count > 1)
+			rects = find_page_rects(&bgf, 1, p, options->pad,
+						&rect_count);
+		result = write_image(temp_paths[p], atlas.pages + p, rects,
+				     rect_count, options,
+				     options->file_threads);
+		stats.image_bytes += file_size(temp_paths[p]);
+		if (result == 0 && options->sdf_spread) {
+			result = write_sdf(temp_paths[sdf_first + p],
+					   atlas.pages + p, rects, rect_count,
+					   options, options->file_threads);
+			stats.image_bytes +=
+				file_size(temp_paths[sdf_first + p]);
+		}
+		free(rects);
+	}
+	end_phase(&stats, STATS_ENCODE, &start);
+
+	// frames decoded straight into the atlas are only found there
+	if (result == 0 && options->hitmask) {
+		if (verbose)
+			printf("Exporting hit masks...\n");
+		result = export_hitmask(&bgf, &atlas,
+					temp_paths[page_count + 1]);
+		stats.metadata_bytes += file_size(temp_paths[page_count + 1]);
+	}
+	free_atlas(&atlas);
 
-	uint8_t **row_pointers = malloc(sizeof(uint8_t *) * bitmap->height);
+	if (result == 0 && options->delta) {
+		result = write_deltas(temp_paths[delta_index], deltas,
+				      delta_size);
+		stats.image_bytes += file_size(temp_paths[delta_index]);
+	}
+	free(deltas);
 
-	for (int i = 0; i < bitmap->height; i++) {
-		row_pointers[i] = bitmap->image_bytes + bitmap->width * i;
+	// manually export meta data to json file
+	if (result == 0) {
+		if (verbose)
+			printf("Exporting metadata to json file...\n");
+		result = export_metadata(&bgf, temp_paths[page_count],
+					 png_names, page_count);
+		stats.metadata_bytes += file_size(temp_paths[page_count]);
+		end_phase(&stats, STATS_METADATA, &start);
 	}
 
-	png_set_rows(png_ptr, info_ptr, (png_bytepp)row_pointers);
+	result = replace_outputs(temp_paths, paths, output_count, result);
+	if (result == 0 && options->cache)
+		update_cache(options->cache, file_name, &key, paths,
+			     output_count);
 
-	png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+	for (int i = 0; i < output_count; i++) {
+		free(paths[i]);
+		free(temp_paths[i]);
+	}
+	free(paths);
+	free(temp_paths);
+	for (int p = 0; p < page_count; p++)
+		free(png_names[p]);
+	free(png_names);
+	free_bgf(&bgf);
+
+	if (result == 0 && options->stats)
+		merge_stats(options->stats, &stats);
+	if (result == 0)
+		printf("%s successfully unpacked\n", file_name);
+	return result;
+}
 
-	png_write_end(png_ptr, NULL);
+int convert_job(struct job_queue *queue, int index)
+{
+	const char *file_name = queue->file_names[index];
+	int result = convert_bgf(file_name, &queue->options);
 
-	png_destroy_write_struct(&png_ptr, &info_ptr);
-	free(row_pointers);
-	fclose(fp);
-	return 0;
+	// its old outputs may be gone, so it is converted again next time
+	if (result && queue->options.cache)
+		invalidate_cache(queue->options.cache, file_name);
+	return result;
 }
 
-int pack_rects()
+/* Loads a file of a shared atlas into queue->bgfs[index], decoded and trimmed
+ * unless its frames get inflated straight into the atlas later. A file that
+ * fails is left without bitmaps, which leaves it out of the atlas.
+ * return 0 on success, -1 on error
+ */
+int load_atlas_job(struct job_queue *queue, int index)
 {
-	struct stbrp_rect *rects = malloc(sizeof(*rects) * bitmap_count);
-	for (int i = 0; i < bitmap_count; i++) {
-		struct stbrp_rect *r = &rects[i];
-		r->w = bitmaps[i].width + ATLAS_PAD * 2;
-		r->h = bitmaps[i].height + ATLAS_PAD * 2;
+	const struct convert_options *options = &queue->options;
+	const char *file_name = queue->file_names[index];
+	struct bgf *bgf = queue->bgfs + index;
+	struct stats stats = { 0 };
+	double start = now_seconds();
+
+	if (open_bgf(bgf, file_name)) {
+		print_bgf_error(bgf);
+		return -1;
 	}
 
-	int dim = 256;
-	int result = 0;
-	while (dim < ATLAS_MAX_DIM) {
-		struct stbrp_context ctx;
-		struct stbrp_node *nodes = malloc(sizeof(*nodes) * dim);
-		stbrp_init_target(&ctx, dim, dim, nodes, dim);
-		result = stbrp_pack_rects(&ctx, rects, bitmap_count);
-		free(nodes);
-		if (result) {
-			break;
-		}
-		dim *= 2;
+	if (load_bgf(bgf)) {
+		print_bgf_error(bgf);
+		free_bgf(bgf);
+		return -1;
 	}
 
-	if (!result) {
-		free(rects);
+	if (bgf->bitmap_count < 1) {
+		fprintf(stderr, "Error: %s contains no bitmaps\n", file_name);
+		free_bgf(bgf);
 		return -1;
 	}
+	count_bgf(&stats, bgf);
+	end_phase(&stats, STATS_LOAD, &start);
+
+	if (!options->direct_decode) {
+		if (decode_bgf(bgf, options->file_threads)) {
+			print_bgf_error(bgf);
+			free_bgf(bgf);
+			return -1;
+		}
+		count_inflated(&stats, bgf);
+		end_phase(&stats, STATS_DECODE, &start);
+	}
 
-	for (int i = 0; i < bitmap_count; i++) {
-		struct stbrp_rect *r = &rects[i];
-		bitmaps[i].x_pos = r->x + ATLAS_PAD;
-		bitmaps[i].y_pos = r->y + ATLAS_PAD;
+	// every file keeps its own deltas, written before its frames are
+	// trimmed
+	int result = 0;
+	if (options->delta) {
+		uint8_t *deltas = NULL;
+		size_t delta_size = 0;
+		char *name = change_ext(path_base(file_name), "bgd");
+		char *path = options->out_dir ?
+				     cat_dir_base(options->out_dir, name) :
+				     strdup(name);
+		result = encode_deltas(bgf, &deltas, &delta_size);
+		if (result)
+			fprintf(stderr, "Error: Failed to delta encode %s\n",
+				file_name);
+		else
+			result = write_deltas(path, deltas, delta_size);
+		stats.image_bytes += file_size(path);
+		end_phase(&stats, STATS_ENCODE, &start);
+		free(deltas);
+		free(path);
+		free(name);
 	}
 
-	free(rects);
-	return 0;
+	if (options->trim) {
+		for (int i = 0; i < bgf->bitmap_count; i++)
+			trim_bitmap(bgf->bitmaps + i);
+		end_phase(&stats, STATS_PACK, &start);
+	}
+
+	if (options->stats)
+		merge_stats(options->stats, &stats);
+	return result;
 }
 
-int pack_bitmaps(struct bitmap *b)
+/* Parses only the headers of a file into queue->bgfs[index] for the catalog.
+ * Frame payloads are skipped over and never read, so only the pages of the
+ * mapping holding headers are touched. A file that fails is left zeroed.
+ * return 0 on success, -1 on error
+ */
+int scan_job(struct job_queue *queue, int index)
 {
-	if (pack_rects() == -1) {
+	struct bgf *bgf = queue->bgfs + index;
+	struct stats stats = { 0 };
+	double start = now_seconds();
+
+	// open_bgf keeps the name of a file it fails on, for the error
+	if (open_bgf(bgf, queue->file_names[index])) {
+		print_bgf_error(bgf);
+		free_bgf(bgf);
 		return -1;
 	}
-	int max_width = 0;
-	int max_height = 0;
-	for (int i = 0; i < bitmap_count; i++) {
-		struct bitmap *bm = &bitmaps[i];
-		int width = bm->x_pos + bm->width + ATLAS_PAD;
-		int height = bm->y_pos + bm->height + ATLAS_PAD;
-		if (width > max_width)
-			max_width = width;
-		if (height > max_height)
-			max_height = height;
-	}
-	b->width = max_width;
-	b->height = max_height;
-	b->image_bytes = malloc(max_width * max_height);
-	memset(b->image_bytes, TRANSPARENT_INDEX, max_width * max_height);
-
-	for (int i = 0; i < bitmap_count; i++) {
-		struct bitmap *bm = &bitmaps[i];
-
-		int x = bm->x_pos;
-		int y = bm->y_pos;
-		int w = bm->width;
-		int h = bm->height;
-
-		uint8_t *bp = bm->image_bytes;
-		uint8_t *ap = b->image_bytes;
-		for (int r = 0; r < h; r++) {
-			uint8_t *src = &bp[r * w];
-			uint8_t *dst = &ap[x + (y + r) * b->width];
-			memcpy(dst, src, w);
-		}
+
+	if (load_bgf(bgf)) {
+		print_bgf_error(bgf);
+		free_bgf(bgf);
+		return -1;
+	}
+
+	if (queue->options.stats) {
+		count_bgf(&stats, bgf);
+		end_phase(&stats, STATS_LOAD, &start);
+		merge_stats(queue->options.stats, &stats);
 	}
 	return 0;
 }
 
-// return 0 on success, -1 on failure
-int export_metadata(char *json_file_name, char *png_file_name)
+void *job_worker(void *arg)
 {
-	FILE *fp = fopen(json_file_name, "w");
+	struct job_queue *queue = arg;
 
-	if (!fp) {
-		fprintf(stderr, "Error: Failed to create json %s: %s\n",
-			json_file_name, strerror(errno));
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		int i = queue->next_file++;
+		pthread_mutex_unlock(&queue->lock);
+
+		if (i >= queue->file_count)
+			break;
+
+		if (queue->run_job(queue, i)) {
+			pthread_mutex_lock(&queue->lock);
+			queue->failed_count++;
+			pthread_mutex_unlock(&queue->lock);
+		}
+	}
+
+	return NULL;
+}
+
+// runs the job of every file in the queue on job_count threads
+void run_jobs(struct job_queue *queue, int job_count)
+{
+	queue->next_file = 0;
+
+	if (job_count <= 1) {
+		job_worker(queue);
+		return;
+	}
+
+	// whatever the threads that couldn't be started leave is run here
+	pthread_t *threads = malloc(sizeof(*threads) * job_count);
+	int started = 0;
+	for (int i = 0; threads && i < job_count; i++) {
+		if (pthread_create(&threads[started], NULL, job_worker,
+				   queue) == 0)
+			started++;
+	}
+	if (started < job_count)
+		job_worker(queue);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+/* Packs the frames of every loaded bgf in the queue into one set of shared
+ * pages, named after options->atlas_name, with a single json index for all of
+ * them. Groups are still kept together on a page, and --dedup shares
+ * rectangles between files too.
+ * return 0 on success, -1 on error
+ */
+int build_atlas(struct job_queue *queue, int thread_count)
+{
+	const struct convert_options *options = &queue->options;
+	const char *out_dir = options->out_dir;
+	struct bgf *bgfs = queue->bgfs;
+	int bgf_count = queue->file_count;
+	struct stats stats = { 0 };
+	double start = now_seconds();
+
+	int bitmap_count = 0;
+	int loaded_count = 0;
+	for (int b = 0; b < bgf_count; b++) {
+		bitmap_count += bgfs[b].bitmap_count;
+		loaded_count += bgfs[b].bitmap_count > 0;
+	}
+
+	if (loaded_count == 0) {
+		fprintf(stderr, "Error: No bitmaps to pack into %s\n",
+			options->atlas_name);
 		return -1;
 	}
 
-	fprintf(fp, "{");
-	fprintf(fp, "\"name\":\"%s\",", bitmap_name);
-	fprintf(fp, "\"version\":%d,", version);
-	fprintf(fp, "\"sprite_count\":%d,", bitmap_count);
-	fprintf(fp, "\"group_count\":%d,", group_count);
-	fprintf(fp, "\"shrink_factor\":%d,", shrink_factor);
-	fprintf(fp, "\"image_file\":\"%s\",", png_file_name);
-	fprintf(fp, "\"sprites\":[");
-
-	for (int i = 0; i < bitmap_count; i++) {
-		struct bitmap *bitmap = bitmaps + i;
-		fprintf(fp, "{");
-		fprintf(fp, "\"x_pos\":%d,", bitmap->x_pos);
-		fprintf(fp, "\"y_pos\":%d,", bitmap->y_pos);
-		fprintf(fp, "\"width\":%d,", bitmap->width);
-		fprintf(fp, "\"height\":%d,", bitmap->height);
-		fprintf(fp, "\"x_offset\":%d,", bitmap->x_offset);
-		fprintf(fp, "\"y_offset\":%d,", bitmap->y_offset);
-		fprintf(fp, "\"hotspot_count\":%d,",
-			bitmap->hotspot_count);
-		fprintf(fp, "\"hotspots\":[");
-		for (int j = 0; j < bitmap->hotspot_count; j++) {
-			struct hotspot *hotspot = bitmap->hotspots + j;
-			fprintf(fp, "{");
-			fprintf(fp, "\"number\":%d,",
-				hotspot->number);
-			fprintf(fp, "\"x\":%d,", hotspot->x);
-			fprintf(fp, "\"y\":%d", hotspot->y);
-			if (j == bitmap->hotspot_count - 1) {
-				fprintf(fp, "}");
-			} else {
-				fprintf(fp, "},");
-			}
-		}
-		fprintf(fp, "]");
-		if (i == bitmap_count - 1) {
-			fprintf(fp, "}");
-		} else {
-			fprintf(fp, "},");
+	printf("Packing %d bitmaps of %d files into %s\n", bitmap_count,
+	       loaded_count, options->atlas_name);
+
+	if (options->dedup) {
+		struct bitmap **bitmaps = malloc(sizeof(*bitmaps) * bitmap_count);
+		int i = 0;
+		for (int b = 0; b < bgf_count; b++) {
+			for (int j = 0; j < bgfs[b].bitmap_count; j++)
+				bitmaps[i++] = bgfs[b].bitmaps + j;
 		}
+		int duplicate_count =
+			find_duplicate_bitmaps(bitmaps, bitmap_count);
+		free(bitmaps);
+		printf("Found %d duplicate bitmaps\n", duplicate_count);
 	}
-	fprintf(fp, "],");
-	fprintf(fp, "\"groups\":[");
-	int indexes_offset = 0;
-	for (int i = 0; i < group_count; i++) {
-		fprintf(fp, "{");
-		fprintf(fp, "\"index_count\":%d,", bitmap_groups[i]);
-		fprintf(fp, "\"indexes\":[");
-		for (int j = 0; j < bitmap_groups[i]; ++j) {
-			if (j == bitmap_groups[i] - 1) {
-				fprintf(fp, "%d]",
-					bitmap_indexes[j + indexes_offset]);
-			} else {
-				fprintf(fp, "%d,",
-					bitmap_indexes[j + indexes_offset]);
+
+	struct atlas atlas = { 0 };
+	if (pack_bgfs(bgfs, bgf_count, &atlas, options->max_dim, options->pad,
+		      thread_count) == -1) {
+		fprintf(stderr,
+			"Error: Failed to pack %s, a bitmap is larger than %dx%d\n",
+			options->atlas_name, options->max_dim, options->max_dim);
+		return -1;
+	}
+
+	if (options->direct_decode)
+		end_phase(&stats, STATS_PACK, &start);
+	for (int b = 0; b < bgf_count; b++) {
+		if (!options->direct_decode) {
+			copy_bitmaps(bgfs + b, &atlas);
+		} else if (bgfs[b].bitmap_count > 0) {
+			if (decode_bgf_into(bgfs + b, atlas.pages,
+					    thread_count)) {
+				print_bgf_error(bgfs + b);
+				free_atlas(&atlas);
+				return -1;
 			}
+			count_inflated(&stats, bgfs + b);
 		}
-		indexes_offset += bitmap_groups[i];
-		if (i == group_count - 1) {
-			fprintf(fp, "}");
-		} else {
-			fprintf(fp, "},");
+	}
+	end_phase(&stats, options->direct_decode ? STATS_DECODE : STATS_PACK,
+		  &start);
+
+	for (int b = 0; b < bgf_count && options->gutter; b++)
+		extrude_bitmaps(bgfs + b, &atlas, options->gutter);
+	count_atlas(&stats, bgfs, bgf_count, &atlas);
+	end_phase(&stats, STATS_PACK, &start);
+
+	// a single page keeps the plain <name>.png, more are <name>_<page>.png,
+	// or .dds
+	int page_count = atlas.page_count;
+	char **png_names = malloc(sizeof(char *) * page_count);
+	for (int p = 0; p < page_count; p++) {
+		if (page_count == 1)
+			png_names[p] = change_ext(options->atlas_name,
+						  image_ext(options));
+		else
+			png_names[p] = page_file_name(options->atlas_name, p,
+						      image_ext(options));
+	}
+
+	int result = 0;
+	for (int p = 0; p < page_count && result == 0; p++) {
+		char *png_path = out_dir ? cat_dir_base(out_dir, png_names[p]) :
+					   png_names[p];
+		int rect_count;
+		struct mip_rect *rects = find_page_rects(
+			bgfs, bgf_count, p, options->pad, &rect_count);
+		result = write_image(png_path, atlas.pages + p, rects,
+				     rect_count, options, thread_count);
+		stats.image_bytes += file_size(png_path);
+		if (result == 0 && options->sdf_spread) {
+			char *sdf_path = sdf_file_name(png_path);
+			result = write_sdf(sdf_path, atlas.pages + p, rects,
+					   rect_count, options, thread_count);
+			stats.image_bytes += file_size(sdf_path);
+			free(sdf_path);
 		}
+		free(rects);
+		if (out_dir)
+			free(png_path);
+	}
+	end_phase(&stats, STATS_ENCODE, &start);
+
+	// every file keeps its own mask, indexed like its sprites in the json
+	for (int b = 0; b < bgf_count && result == 0 && options->hitmask;
+	     b++) {
+		if (bgfs[b].bitmap_count == 0)
+			continue;
+		char *hit_name =
+			change_ext(path_base(bgfs[b].file_name), "hit");
+		char *hit_path = out_dir ? cat_dir_base(out_dir, hit_name) :
+					   hit_name;
+		result = export_hitmask(bgfs + b, &atlas, hit_path);
+		stats.metadata_bytes += file_size(hit_path);
+		if (out_dir)
+			free(hit_path);
+		free(hit_name);
+	}
+	free_atlas(&atlas);
+
+	char *json_name = change_ext(options->atlas_name, "json");
+	char *json_path = out_dir ? cat_dir_base(out_dir, json_name) :
+				    json_name;
+	if (result == 0) {
+		result = export_atlas_metadata(bgfs, bgf_count, json_path,
+					       png_names, page_count);
+		stats.metadata_bytes += file_size(json_path);
+		end_phase(&stats, STATS_METADATA, &start);
+	}
+	if (options->stats)
+		merge_stats(options->stats, &stats);
+
+	if (out_dir)
+		free(json_path);
+	free(json_name);
+	for (int p = 0; p < page_count; p++)
+		free(png_names[p]);
+	free(png_names);
+
+	if (result == 0)
+		printf("%s successfully packed into %d page(s)\n",
+		       options->atlas_name, page_count);
+	return result;
+}
+
+// writes the catalog of every scanned bgf, return 0 on success, -1 on error
+int build_catalog(struct job_queue *queue)
+{
+	const char *out_dir = queue->options.out_dir;
+	int frame_count = 0;
+	int loaded_count = 0;
+
+	// files that failed are zeroed, without a name
+	for (int b = 0; b < queue->file_count; b++) {
+		frame_count += queue->bgfs[b].bitmap_count;
+		loaded_count += queue->bgfs[b].file_name != NULL;
+	}
+
+	struct stats stats = { 0 };
+	double start = now_seconds();
+	char *json_name = change_ext(queue->options.scan_name, "json");
+	char *json_path = out_dir ? cat_dir_base(out_dir, json_name) :
+				    json_name;
+	int result = export_catalog(queue->bgfs, queue->file_count, json_path);
+
+	if (queue->options.stats) {
+		stats.metadata_bytes = file_size(json_path);
+		end_phase(&stats, STATS_METADATA, &start);
+		merge_stats(queue->options.stats, &stats);
+	}
+
+	if (result == 0)
+		printf("Indexed %d frames of %d files into %s\n", frame_count,
+		       loaded_count, json_path);
+	if (out_dir)
+		free(json_path);
+	free(json_name);
+	return result;
+}
+
+int has_bgf_ext(const char *file_name)
+{
+	const char *dot = strrchr(file_name, '.');
+	return dot && strcasecmp(dot, ".bgf") == 0;
+}
+
+/* Appends a command line input to the queue. Directories are expanded to every
+ * .bgf file directly inside them, in sorted order so runs are reproducible.
+ * return 0 on success, -1 on error
+ */
+int add_input(struct job_queue *queue, const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st)) {
+		fprintf(stderr, "Error: Failed to open %s: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		queue->file_names = realloc(queue->file_names,
+					    sizeof(char *) *
+						    (queue->file_count + 1));
+		queue->file_names[queue->file_count] = strdup(path);
+		queue->file_count++;
+		return 0;
 	}
-	fprintf(fp, "]");
-	fprintf(fp, "}");
-	fclose(fp);
+
+	DIR *dir = opendir(path);
+
+	if (!dir) {
+		fprintf(stderr, "Error: Failed to open directory %s: %s\n",
+			path, strerror(errno));
+		return -1;
+	}
+
+	int first = queue->file_count;
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		if (!has_bgf_ext(entry->d_name))
+			continue;
+		queue->file_names = realloc(queue->file_names,
+					    sizeof(char *) *
+						    (queue->file_count + 1));
+		queue->file_names[queue->file_count] =
+			cat_dir_base(path, entry->d_name);
+		queue->file_count++;
+	}
+	closedir(dir);
+
+	qsort(queue->file_names + first, queue->file_count - first,
+	      sizeof(char *), compare_strings);
 	return 0;
 }
 
+// orders paths by their base name without the extension
+int compare_base_names(const void *a, const void *b)
+{
+	const char *name_a = path_base(*(char *const *)a);
+	const char *name_b = path_base(*(char *const *)b);
+	const char *dot_a = strrchr(name_a, '.');
+	const char *dot_b = strrchr(name_b, '.');
+	size_t len_a = dot_a ? (size_t)(dot_a - name_a) : strlen(name_a);
+	size_t len_b = dot_b ? (size_t)(dot_b - name_b) : strlen(name_b);
+	int diff = strncmp(name_a, name_b, len_a < len_b ? len_a : len_b);
+
+	if (diff)
+		return diff;
+	return (len_a > len_b) - (len_a < len_b);
+}
+
+/* Outputs are named after the base name of their input, and the shared atlas
+ * json is keyed by it, so two inputs with the same base name in different
+ * directories would write over each other.
+ * return 0 on success, -1 if two inputs share their outputs
+ */
+int check_output_names(const struct job_queue *queue)
+{
+	char **sorted = malloc(sizeof(*sorted) * queue->file_count);
+	int result = 0;
+
+	memcpy(sorted, queue->file_names, sizeof(*sorted) * queue->file_count);
+	qsort(sorted, queue->file_count, sizeof(*sorted), compare_base_names);
+
+	for (int i = 1; i < queue->file_count && result == 0; i++) {
+		if (compare_base_names(sorted + i - 1, sorted + i) == 0) {
+			fprintf(stderr,
+				"Error: %s and %s would write the same outputs\n",
+				sorted[i - 1], sorted[i]);
+			result = -1;
+		}
+	}
+
+	free(sorted);
+	return result;
+}
+
+/* Describes the tool version and every option the outputs depend on, so a
+ * cache only counts outputs of a run with the same settings as up to date.
+ * return a malloced string
+ */
+char *describe_options(const struct convert_options *options,
+		       const char *store_dir)
+{
+	const char *out_dir = options->out_dir ? options->out_dir : ".";
+	const char *store = store_dir ? store_dir : "-";
+	size_t len = strlen(out_dir) + strlen(store) + 256;
+	char *text = malloc(len);
+
+	snprintf(text, len,
+		 "bgf2png %s out=%s store=%s format=%s png=%s premultiply=%d "
+		 "mipmaps=%d trim=%d dedup=%d pad=%d gutter=%d max_dim=%d "
+		 "hitmask=%d sdf=%d delta=%d",
+		 BGF2PNG_VERSION, out_dir, store,
+		 options->dds.format == -1 ?
+			 "png" :
+			 dds_format_names[options->dds.format],
+		 png_preset_names[options->png_preset],
+		 options->dds.premultiply, options->dds.mipmaps, options->trim,
+		 options->dedup, options->pad, options->gutter,
+		 options->max_dim, options->hitmask, options->sdf_spread,
+		 options->delta);
+	return text;
+}
+
+void print_usage(const char *program)
+{
+	printf("Usage: %s [options] <bgf file | directory>...\n", program);
+	printf("Options:\n");
+	printf("  -j, --jobs <count>    number of files converted at once "
+	       "(default: core count)\n");
+	printf("  -o, --output <dir>    output directory "
+	       "(default: current directory)\n");
+	printf("  -d, --direct          decompress frames straight into the "
+	       "atlas\n");
+	printf("  -t, --trim            pack only the opaque part of each "
+	       "bitmap\n");
+	printf("  -u, --dedup           pack pixel identical bitmaps only "
+	       "once\n");
+	printf("  -g, --gutter <width>  border around every sprite filled "
+	       "with its edge pixels\n"
+	       "                        (default: %d transparent pixel)\n",
+	       ATLAS_PAD);
+	printf("  -a, --atlas <name>    pack every input into one shared atlas "
+	       "<name>.png with\n"
+	       "                        a combined <name>.json index\n");
+	printf("  -s, --store <dir>     write every unique frame once to <dir>, "
+	       "named by its\n"
+	       "                        contents, instead of packing atlases\n");
+	printf("  -p, --png <preset>    png compression: fast, default or "
+	       "smallest\n"
+	       "                        (default: default)\n");
+	printf("  -f, --format <format> image format: png, or dds with bc1 "
+	       "or bc3 blocks,\n"
+	       "                        r8 palette indexes or rgba "
+	       "(default: png)\n");
+	printf("  -P, --premultiply     premultiply alpha of rgba textures\n");
+	printf("  -M, --mipmaps         store a full mip chain in dds "
+	       "textures, filtered within\n"
+	       "                        each sprite\n");
+	printf("  -H, --hitmask         write a 1 bit opacity mask and the "
+	       "opaque bounds of every\n"
+	       "                        frame to <name>.hit\n");
+	printf("  -D, --sdf <spread>    write a signed distance field of "
+	       "every page, reaching\n"
+	       "                        <spread> pixels out from the sprites, "
+	       "to <page>_sdf.png\n");
+	printf("  -e, --delta           also write every frame to <name>.bgd, "
+	       "later frames of a\n"
+	       "                        group as the tiles changed since the "
+	       "one before\n");
+	printf("  -S, --scan <name>     only read the headers of every input "
+	       "into one compact\n"
+	       "                        <name>.json catalog, without "
+	       "decompressing frames\n");
+	printf("  -c, --cache <file>    skip inputs whose outputs recorded in "
+	       "this manifest are\n"
+	       "                        up to date, and record the ones "
+	       "converted\n");
+	printf("      --stats[=<format>] report time per phase, bytes read, "
+	       "inflated and written,\n"
+	       "                        atlas fill and peak memory at the "
+	       "end, as text or json\n");
+	printf("  -m, --max-dim <size>  largest atlas page width and height, "
+	       "more pages are\n"
+	       "                        written when needed (default: %d)\n",
+	       ATLAS_MAX_DIM);
+}
+
 int main(int argc, char **argv)
 {
-	if (argc < 2) {
-		printf("Usage: %s <bgf file>\n", argv[0]);
+	static const struct option long_options[] = {
+		{ "jobs", required_argument, NULL, 'j' },
+		{ "output", required_argument, NULL, 'o' },
+		{ "direct", no_argument, NULL, 'd' },
+		{ "max-dim", required_argument, NULL, 'm' },
+		{ "dedup", no_argument, NULL, 'u' },
+		{ "trim", no_argument, NULL, 't' },
+		{ "gutter", required_argument, NULL, 'g' },
+		{ "atlas", required_argument, NULL, 'a' },
+		{ "store", required_argument, NULL, 's' },
+		{ "png", required_argument, NULL, 'p' },
+		{ "format", required_argument, NULL, 'f' },
+		{ "premultiply", no_argument, NULL, 'P' },
+		{ "mipmaps", no_argument, NULL, 'M' },
+		{ "hitmask", no_argument, NULL, 'H' },
+		{ "sdf", required_argument, NULL, 'D' },
+		{ "delta", no_argument, NULL, 'e' },
+		{ "scan", required_argument, NULL, 'S' },
+		{ "cache", required_argument, NULL, 'c' },
+		{ "stats", optional_argument, NULL, 'T' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct job_queue queue = { 0 };
+	struct convert_options *options = &queue.options;
+	long core_count = sysconf(_SC_NPROCESSORS_ONLN);
+	long job_count = core_count;
+	const char *store_dir = NULL;
+	const char *cache_file = NULL;
+	struct store store;
+	struct cache cache;
+	struct stats stats = { 0 };
+	int stats_format = STATS_TEXT;
+	double start = now_seconds();
+	int opt;
+
+	options->max_dim = ATLAS_MAX_DIM;
+	options->pad = ATLAS_PAD;
+	options->png_preset = PNG_PRESET_DEFAULT;
+	options->dds.format = -1;
+
+	while ((opt = getopt_long(argc, argv,
+				  "j:o:dm:utg:a:s:p:f:PMHD:eS:c:h",
+				  long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'j':
+			job_count = strtol(optarg, NULL, 10);
+			break;
+		case 'o':
+			options->out_dir = optarg;
+			break;
+		case 'd':
+			options->direct_decode = 1;
+			break;
+		case 'u':
+			options->dedup = 1;
+			break;
+		case 't':
+			options->trim = 1;
+			break;
+		case 'g':
+			options->gutter = strtol(optarg, NULL, 10);
+			options->pad = options->gutter;
+			if (options->gutter < 0) {
+				fprintf(stderr, "Error: Bad gutter width %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'a':
+			options->atlas_name = optarg;
+			break;
+		case 's':
+			store_dir = optarg;
+			break;
+		case 'S':
+			options->scan_name = optarg;
+			break;
+		case 'c':
+			cache_file = optarg;
+			break;
+		case 'T':
+			options->stats = &stats;
+			if (optarg && strcmp(optarg, "json") == 0) {
+				stats_format = STATS_JSON;
+			} else if (optarg && strcmp(optarg, "text") != 0) {
+				fprintf(stderr, "Error: Unknown stats format "
+						"%s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'p':
+			options->png_preset = find_png_preset(optarg);
+			if (options->png_preset == -1) {
+				fprintf(stderr, "Error: Unknown png preset %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'f':
+			options->dds.format = find_dds_format(optarg);
+			if (options->dds.format == -1 &&
+			    strcmp(optarg, "png") != 0) {
+				fprintf(stderr, "Error: Unknown format %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'P':
+			options->dds.premultiply = 1;
+			break;
+		case 'M':
+			options->dds.mipmaps = 1;
+			break;
+		case 'H':
+			options->hitmask = 1;
+			break;
+		case 'e':
+			options->delta = 1;
+			break;
+		case 'D':
+			options->sdf_spread = strtol(optarg, NULL, 10);
+			if (options->sdf_spread < 1) {
+				fprintf(stderr, "Error: Bad distance field "
+						"spread %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			options->max_dim = strtol(optarg, NULL, 10);
+			if (options->max_dim < 1) {
+				fprintf(stderr, "Error: Bad page size %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			print_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc) {
+		print_usage(argv[0]);
 		return EXIT_SUCCESS;
 	}
 
-	// open bgf file
-	bgf_file = fopen(argv[1], "r");
+	// these passes look at the pixels of every frame before packing
+	if (options->direct_decode &&
+	    (options->dedup || options->trim || options->delta)) {
+		fprintf(stderr, "Error: --direct can't be combined with "
+				"--dedup, --trim or --delta\n");
+		return EXIT_FAILURE;
+	}
+
+	if (store_dir && (options->direct_decode || options->atlas_name)) {
+		fprintf(stderr, "Error: --store can't be combined with "
+				"--direct or --atlas\n");
+		return EXIT_FAILURE;
+	}
 
-	if (bgf_file == NULL) {
-		fprintf(stderr, "Error: Failed to open %s: %s\n", argv[1],
-			strerror(errno));
+	if (options->scan_name && (store_dir || options->atlas_name ||
+				   options->hitmask || options->delta)) {
+		fprintf(stderr, "Error: --scan can't be combined with "
+				"--store, --atlas, --hitmask or --delta\n");
 		return EXIT_FAILURE;
 	}
 
-	printf("Unpacking %s\n", argv[1]);
+	// frames in the store are separate images without atlas pages
+	if (options->sdf_spread && (store_dir || options->scan_name)) {
+		fprintf(stderr, "Error: --sdf can't be combined with "
+				"--store or --scan\n");
+		return EXIT_FAILURE;
+	}
+
+	// the field reaches into the free space around every sprite
+	if (options->sdf_spread > options->pad)
+		options->pad = options->sdf_spread;
+
+	// an atlas or catalog depends on every input at once
+	if (cache_file && (options->atlas_name || options->scan_name)) {
+		fprintf(stderr, "Error: --cache can't be combined with "
+				"--atlas or --scan\n");
+		return EXIT_FAILURE;
+	}
+
+	if (options->dds.mipmaps && options->dds.format == -1) {
+		fprintf(stderr, "Error: --mipmaps needs a dds --format\n");
+		return EXIT_FAILURE;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		if (add_input(&queue, argv[i]))
+			return EXIT_FAILURE;
+	}
+
+	if (queue.file_count == 0) {
+		fprintf(stderr, "Error: No bgf files to convert\n");
+		return EXIT_FAILURE;
+	}
+
+	// a catalog is the only output of a scan
+	if (!options->scan_name && check_output_names(&queue))
+		return EXIT_FAILURE;
 
-	load_bgf();
+	if (options->out_dir && mkdir(options->out_dir, 0755) &&
+	    errno != EEXIST) {
+		fprintf(stderr, "Error: Failed to create directory %s: %s\n",
+			options->out_dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	// r8 textures only hold indexes, the colors go out once for all of them
+	if (options->dds.format == DDS_R8 && !options->scan_name) {
+		char *palette_path =
+			options->out_dir ?
+				cat_dir_base(options->out_dir, DDS_PALETTE_FILE) :
+				strdup(DDS_PALETTE_FILE);
+		int result = write_palette_dds(palette_path);
+		free(palette_path);
+		if (result)
+			return EXIT_FAILURE;
+	}
 
-	struct bitmap b = { 0 };
-	if (bitmap_count > 1) {
-		printf("Converting bitmaps to PNG atlas...\n");
-		if (pack_bitmaps(&b) == -1) {
-			fprintf(stderr, "%s%s",
-				"Error: Failed to pack bitmaps,",
-				" try increasing ATLAS_MAX_DIM\n");
-			cleanup();
+	if (store_dir) {
+		if (init_store(&store, store_dir))
+			return EXIT_FAILURE;
+		options->store = &store;
+	}
+
+	char *cache_options = NULL;
+	if (cache_file) {
+		cache_options = describe_options(options, store_dir);
+		if (load_cache(&cache, cache_file, cache_options)) {
+			free(cache_options);
 			return EXIT_FAILURE;
 		}
-	} else {
-		printf("Converting bitmap to PNG...\n");
-		b = bitmaps[0];
+		options->cache = &cache;
 	}
 
-	size_t name_length = strlen(basename(argv[1])) + 5;
-	char *png_name = malloc(name_length * sizeof(char));
-	strcpy(png_name, basename(argv[1]));
-	char *dot_loc = strrchr(png_name, '.');
-	if (dot_loc) {
-		sprintf(dot_loc, ".png");
+	if (job_count < 1)
+		job_count = 1;
+	if (job_count > queue.file_count)
+		job_count = queue.file_count;
+
+	// step by step progress only makes sense for a single file
+	options->verbose = queue.file_count == 1;
+
+	// cores not busy with a file of their own help with each file instead
+	options->file_threads = core_count / job_count;
+	if (options->file_threads < 1)
+		options->file_threads = 1;
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_mutex_init(&stats.lock, NULL);
+
+	int result = EXIT_SUCCESS;
+	if (options->scan_name) {
+		queue.bgfs = calloc(queue.file_count, sizeof(*queue.bgfs));
+		queue.run_job = scan_job;
+		run_jobs(&queue, job_count);
+		if (build_catalog(&queue))
+			result = EXIT_FAILURE;
+		for (int i = 0; i < queue.file_count; i++)
+			free_bgf(queue.bgfs + i);
+		free(queue.bgfs);
+	} else if (options->atlas_name) {
+		queue.bgfs = calloc(queue.file_count, sizeof(*queue.bgfs));
+		queue.run_job = load_atlas_job;
+		run_jobs(&queue, job_count);
+		if (build_atlas(&queue, core_count))
+			result = EXIT_FAILURE;
+		for (int i = 0; i < queue.file_count; i++)
+			free_bgf(queue.bgfs + i);
+		free(queue.bgfs);
 	} else {
-		strcat(png_name, ".png");
+		queue.run_job = convert_job;
+		run_jobs(&queue, job_count);
 	}
-	write_png(png_name, &b);
 
-	// b is the image atlas in this case, needs manual free
-	if (bitmap_count != 1) {
-		free(b.image_bytes);
+	if (options->store) {
+		printf("%d unique frames stored, %d frames shared a stored "
+		       "image\n",
+		       store.stored_count, store.reused_count);
+		free_store(&store);
 	}
 
-	// manually export meta data to json file
-	printf("Exporting metadata to json file...\n");
+	if (options->cache) {
+		if (cache.skipped_count)
+			printf("%d unchanged files skipped\n",
+			       cache.skipped_count);
+		if (save_cache(&cache))
+			result = EXIT_FAILURE;
+		free_cache(&cache);
+		free(cache_options);
+	}
 
-	char *json_name = malloc(strlen(basename(argv[1])) + 6);
-	strcpy(json_name, basename(argv[1]));
-	dot_loc = strrchr(json_name, '.');
-	if (dot_loc) {
-		sprintf(dot_loc, ".json");
-	} else {
-		strcat(json_name, ".json");
+	if (options->stats)
+		print_stats(stdout, &stats, stats_format,
+			    now_seconds() - start);
+
+	pthread_mutex_destroy(&stats.lock);
+	pthread_mutex_destroy(&queue.lock);
+	for (int i = 0; i < queue.file_count; i++)
+		free(queue.file_names[i]);
+	free(queue.file_names);
+
+	if (queue.failed_count) {
+		fprintf(stderr, "Error: Failed to %s %d of %d files\n",
+			options->scan_name ? "index" : "unpack",
+			queue.failed_count, queue.file_count);
+		return EXIT_FAILURE;
 	}
-	export_metadata(json_name, png_name);
 
-	free(json_name);
-	free(png_name);
-	cleanup();
-	printf("%s successfully unpacked\n", argv[1]);
-	return EXIT_SUCCESS;
-}
\ No newline at end of file
+	return result;
+}
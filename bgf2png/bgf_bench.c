@@ -0,0 +1,685 @@
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <setjmp.h>
+#include "png.h"
+#include "zlib.h"
+#include "bgf.h"
+#include "atlas.h"
+#include "png_out.h"
+#include "palette.h"
+#include "metadata.h"
+
+#define BENCH_FILE "bgf_bench.bgf"
+#define BENCH_JSON "bgf_bench.json"
+#define DEFAULT_FRAMES 10000
+#define DEFAULT_REPS 10
+// encoding with the smallest preset is slow, so it is repeated less
+#define MAX_ENCODE_REPS 3
+// synthetic files written per corpus profile
+#define CORPUS_COPIES 4
+
+// phases timed on every file of a corpus
+#define PHASE_LOAD 0
+#define PHASE_PACK 1
+#define PHASE_ENCODE 2
+#define PHASE_METADATA 3
+#define PHASE_COUNT 4
+
+const char *phase_names[PHASE_COUNT] = { "load", "pack", "encode",
+					 "metadata" };
+
+/* Shape of a synthetic bgf: how many frames of what size, how they are stored,
+ * how many hotspots they have and how they are grouped.
+ */
+struct corpus_profile {
+	const char *name;
+	int frame_count;
+	int min_size, max_size;
+	// every raw_every-th frame is stored uncompressed, never if 0
+	int raw_every;
+	int max_hotspots;
+	// frames per group, the last group takes what is left
+	int group_size;
+};
+
+// roughly the kinds of bgf in a client resource folder
+const struct corpus_profile corpus_profiles[] = {
+	// single uncompressed wall and floor textures
+	{ "wall", 1, 64, 256, 1, 0, 1 },
+	// items and small objects, a few frames in one group
+	{ "object", 6, 16, 64, 0, 1, 6 },
+	// monsters, a group of 8 view directions per animation frame
+	{ "monster", 96, 32, 112, 0, 2, 8 },
+	// spell effects, many small frames, half of them raw
+	{ "effect", 240, 8, 40, 2, 0, 12 },
+	// interface elements, one group per frame
+	{ "interface", 400, 8, 48, 5, 1, 1 },
+};
+#define CORPUS_PROFILE_COUNT \
+	((int)(sizeof(corpus_profiles) / sizeof(corpus_profiles[0])))
+
+// small deterministic generator so every run parses the same file
+static uint32_t rng_state = 0x12345678;
+
+uint32_t next_random()
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+double now_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void write_u32(FILE *fp, uint32_t value)
+{
+	fwrite(&value, sizeof(value), 1, fp);
+}
+
+/* Writes a bgf shaped by profile, its frames filled with short runs of palette
+ * indexes and transparent borders so the payloads compress about as well as
+ * real sprites do.
+ * return 0 on success, -1 on error
+ */
+int write_synthetic_bgf(const char *file_name,
+			const struct corpus_profile *profile)
+{
+	FILE *fp = fopen(file_name, "wb");
+
+	if (!fp) {
+		fprintf(stderr, "Error: Failed to create %s: %s\n", file_name,
+			strerror(errno));
+		return -1;
+	}
+
+	int frame_count = profile->frame_count;
+	int group_size = profile->group_size;
+	int group_count = (frame_count + group_size - 1) / group_size;
+	int size_range = profile->max_size - profile->min_size + 1;
+	size_t max_pixels = (size_t)profile->max_size * profile->max_size;
+
+	char name[32] = { 0 };
+	snprintf(name, sizeof(name), "%s", profile->name);
+	fwrite("BGF\x11", 4, 1, fp);
+	write_u32(fp, BGF_VERSION);
+	fwrite(name, sizeof(name), 1, fp);
+	write_u32(fp, frame_count);
+	write_u32(fp, group_count);
+	write_u32(fp, group_size);
+	write_u32(fp, 1);
+
+	uint8_t *pixels = malloc(max_pixels);
+	uint8_t *compressed = malloc(compressBound(max_pixels));
+
+	for (int i = 0; i < frame_count; i++) {
+		int32_t width = profile->min_size + next_random() % size_range;
+		int32_t height = profile->min_size + next_random() % size_range;
+		int32_t offsets[2] = { -width / 2, -height };
+		uint8_t hotspot_count =
+			next_random() % (profile->max_hotspots + 1);
+		int is_raw = profile->raw_every &&
+			     i % profile->raw_every == profile->raw_every - 1;
+
+		memset(pixels, TRANSPARENT_INDEX, width * height);
+		for (int y = 2; y < height - 2; y++) {
+			uint8_t *row = pixels + y * width;
+			for (int x = 2; x < width - 2;) {
+				int run = 1 + next_random() % 6;
+				uint8_t color = next_random() % 254;
+				for (; run > 0 && x < width - 2; run--, x++)
+					row[x] = color;
+			}
+		}
+
+		uLongf compressed_size = compressBound(max_pixels);
+		compress(compressed, &compressed_size, pixels, width * height);
+
+		fwrite(&width, sizeof(width), 1, fp);
+		fwrite(&height, sizeof(height), 1, fp);
+		fwrite(offsets, sizeof(offsets), 1, fp);
+		fwrite(&hotspot_count, 1, 1, fp);
+		for (int j = 0; j < hotspot_count; j++) {
+			int8_t number = j + 1;
+			int32_t position[2] = { next_random() % width,
+						next_random() % height };
+			fwrite(&number, 1, 1, fp);
+			fwrite(position, sizeof(position), 1, fp);
+		}
+		uint8_t format = is_raw ? 0 : COMPRESSED;
+		fwrite(&format, 1, 1, fp);
+		if (is_raw) {
+			write_u32(fp, width * height);
+			fwrite(pixels, width * height, 1, fp);
+		} else {
+			write_u32(fp, compressed_size);
+			fwrite(compressed, compressed_size, 1, fp);
+		}
+	}
+
+	// consecutive runs of group_size frames
+	for (int g = 0; g < group_count; g++) {
+		int first = g * group_size;
+		int count = frame_count - first < group_size ?
+				    frame_count - first :
+				    group_size;
+		write_u32(fp, count);
+		for (int i = 0; i < count; i++)
+			write_u32(fp, first + i);
+	}
+
+	free(compressed);
+	free(pixels);
+
+	if (fclose(fp)) {
+		fprintf(stderr, "Error: Failed to write %s\n", file_name);
+		return -1;
+	}
+
+	return 0;
+}
+
+// an encoded png being read back
+struct png_source {
+	const uint8_t *data;
+	size_t size;
+	size_t offset;
+};
+
+void read_png_source(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+	struct png_source *source = png_get_io_ptr(png_ptr);
+
+	if (length > source->size - source->offset)
+		png_error(png_ptr, "Unexpected end of png");
+	memcpy(data, source->data + source->offset, length);
+	source->offset += length;
+}
+
+/* Reads an encoded png back with libpng, which checks the crc of every chunk
+ * up to and including IEND, and compares its palette indexes with image.
+ * return 0 if they match, -1 otherwise
+ */
+int check_png(const uint8_t *png, size_t png_size, const struct bitmap *image)
+{
+	struct png_source source = { png, png_size, 0 };
+	png_structp png_ptr;
+	png_infop info_ptr;
+	uint8_t *row = malloc(image->width + 1);
+	int result = -1;
+
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
+					 NULL);
+	info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+	if (!info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		free(row);
+		return -1;
+	}
+
+	png_set_read_fn(png_ptr, &source, read_png_source);
+	png_read_info(png_ptr, info_ptr);
+	if (png_get_image_width(png_ptr, info_ptr) == image->width &&
+	    png_get_image_height(png_ptr, info_ptr) == image->height &&
+	    png_get_bit_depth(png_ptr, info_ptr) == 8 &&
+	    png_get_color_type(png_ptr, info_ptr) == PNG_COLOR_TYPE_PALETTE) {
+		int same = 1;
+		for (int y = 0; y < image->height; y++) {
+			png_read_row(png_ptr, row, NULL);
+			same &= memcmp(row,
+				       image->image_bytes +
+					       (size_t)image->width * y,
+				       image->width) == 0;
+		}
+		png_read_end(png_ptr, NULL);
+		if (same)
+			result = 0;
+	}
+
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	free(row);
+	return result;
+}
+
+/* Encodes every image of a corpus with each png preset on thread_count threads
+ * and reports raw bytes encoded per second and the total output size, best of
+ * reps runs. The output of the first run is read back and checked.
+ * return 0 on success, -1 on error
+ */
+int bench_encode(const char *corpus, struct bitmap *images, int image_count,
+		 int thread_count, int reps)
+{
+	uint64_t raw_size = 0;
+	for (int i = 0; i < image_count; i++)
+		raw_size += (uint64_t)images[i].width * images[i].height;
+
+	printf("encode %s: %d image(s), %.2f MB raw, %d thread(s)\n", corpus,
+	       image_count, raw_size / 1e6, thread_count);
+
+	for (int p = 0; p < PNG_PRESET_COUNT; p++) {
+		double best = 0;
+		uint64_t png_total = 0;
+
+		for (int r = 0; r < reps; r++) {
+			double elapsed = 0;
+			png_total = 0;
+			for (int i = 0; i < image_count; i++) {
+				uint8_t *png;
+				size_t png_size;
+				double start = now_seconds();
+				if (encode_png(images + i, p, thread_count, &png,
+					       &png_size))
+					return -1;
+				elapsed += now_seconds() - start;
+				png_total += png_size;
+
+				if (r == 0 &&
+				    check_png(png, png_size, images + i)) {
+					fprintf(stderr,
+						"Error: %s image %d doesn't "
+						"read back with the %s "
+						"preset\n",
+						corpus, i, png_preset_names[p]);
+					free(png);
+					return -1;
+				}
+				free(png);
+			}
+			if (best == 0 || elapsed < best)
+				best = elapsed;
+		}
+
+		printf("encode %s: %-8s best of %d: %.3f ms, %.1f MB/s, "
+		       "%.2f MB png (%.1f%% of raw)\n",
+		       corpus, png_preset_names[p], reps, best * 1e3,
+		       raw_size / 1e6 / best, png_total / 1e6,
+		       100.0 * png_total / raw_size);
+	}
+
+	return 0;
+}
+
+/* Expands every page of an atlas to RGBA with the scalar kernel and with the
+ * one expand_indexes picks for this cpu, best of reps runs.
+ */
+void bench_expand(struct atlas *atlas, int reps)
+{
+	uint32_t lut[256];
+	size_t max_pixels = 0;
+	uint64_t pixels = 0;
+
+	make_rgba_lut(lut, 0);
+	for (int p = 0; p < atlas->page_count; p++) {
+		size_t size = (size_t)atlas->pages[p].width *
+			      atlas->pages[p].height;
+		pixels += size;
+		if (size > max_pixels)
+			max_pixels = size;
+	}
+	uint8_t *rgba = malloc(max_pixels * 4);
+
+	for (int k = 0; k < 2; k++) {
+		double best = 0;
+		for (int r = 0; r < reps; r++) {
+			double start = now_seconds();
+			for (int p = 0; p < atlas->page_count; p++) {
+				struct bitmap *page = atlas->pages + p;
+				size_t size = (size_t)page->width * page->height;
+				if (k == 0)
+					expand_indexes_scalar(lut,
+							      page->image_bytes,
+							      size, rgba);
+				else
+					expand_indexes(lut, page->image_bytes,
+						       size, rgba);
+			}
+			double elapsed = now_seconds() - start;
+			if (best == 0 || elapsed < best)
+				best = elapsed;
+		}
+
+		printf("expand atlas: %-6s best of %d: %.3f ms, %.0f Mpixels/s, "
+		       "%.2f GB/s rgba\n",
+		       k == 0 ? "scalar" : has_simd_expand() ? "avx2" : "scalar",
+		       reps, best * 1e3, pixels / 1e6 / best,
+		       pixels * 4 / 1e9 / best);
+	}
+
+	free(rgba);
+}
+
+/* Runs every phase of a conversion on one file on a single thread, adding the
+ * time each phase took to seconds: loading with decoding, packing into pages,
+ * encoding the pages as png with the default preset and exporting the json.
+ * return 0 on success, -1 on error
+ */
+int convert_file(const char *file_name, double seconds[PHASE_COUNT],
+		 uint64_t *frame_count, uint64_t *png_size)
+{
+	struct bgf bgf;
+	struct atlas atlas = { 0 };
+	double start = now_seconds();
+
+	if (open_bgf(&bgf, file_name) || load_bgf(&bgf) ||
+	    decode_bgf(&bgf, 1)) {
+		fprintf(stderr, "Error: %s: %s\n", file_name,
+			bgf_strerror(bgf.error));
+		free_bgf(&bgf);
+		return -1;
+	}
+	double now = now_seconds();
+	seconds[PHASE_LOAD] += now - start;
+	start = now;
+
+	// a lone frame is written as it is, like bgf2png does
+	struct bitmap *pages = bgf.bitmaps;
+	int page_count = bgf.bitmap_count;
+	if (bgf.bitmap_count > 1) {
+		if (pack_bitmaps(&bgf, &atlas, ATLAS_MAX_DIM, ATLAS_PAD, 1)) {
+			free_bgf(&bgf);
+			return -1;
+		}
+		copy_bitmaps(&bgf, &atlas);
+		pages = atlas.pages;
+		page_count = atlas.page_count;
+	}
+	now = now_seconds();
+	seconds[PHASE_PACK] += now - start;
+	start = now;
+
+	int result = 0;
+	for (int p = 0; p < page_count && result == 0; p++) {
+		uint8_t *png;
+		size_t size;
+		result = encode_png(pages + p, PNG_PRESET_DEFAULT, 1, &png,
+				    &size);
+		if (result == 0) {
+			*png_size += size;
+			free(png);
+		}
+	}
+	now = now_seconds();
+	seconds[PHASE_ENCODE] += now - start;
+	start = now;
+
+	char **png_names = malloc(sizeof(char *) * (page_count + 1));
+	for (int p = 0; p < page_count; p++)
+		png_names[p] = "bgf_bench.png";
+	if (result == 0)
+		result = export_metadata(&bgf, BENCH_JSON, png_names,
+					 page_count);
+	free(png_names);
+	seconds[PHASE_METADATA] += now_seconds() - start;
+
+	*frame_count += bgf.bitmap_count;
+	free_atlas(&atlas);
+	free_bgf(&bgf);
+	return result;
+}
+
+/* Converts every file of a corpus reps times after one warmup pass, and
+ * reports the best total of each phase.
+ * return 0 on success, -1 on error
+ */
+int bench_corpus(const char *corpus, char **files, int file_count, int reps)
+{
+	double best[PHASE_COUNT] = { 0 };
+	uint64_t frame_count = 0, png_size = 0, file_size = 0;
+
+	for (int i = 0; i < file_count; i++) {
+		struct stat st;
+		if (stat(files[i], &st) == 0)
+			file_size += st.st_size;
+	}
+
+	for (int r = -1; r < reps; r++) {
+		double seconds[PHASE_COUNT] = { 0 };
+		frame_count = 0;
+		png_size = 0;
+		for (int i = 0; i < file_count; i++) {
+			if (convert_file(files[i], seconds, &frame_count,
+					 &png_size)) {
+				remove(BENCH_JSON);
+				return -1;
+			}
+		}
+		for (int p = 0; r >= 0 && p < PHASE_COUNT; p++) {
+			if (best[p] == 0 || seconds[p] < best[p])
+				best[p] = seconds[p];
+		}
+	}
+	remove(BENCH_JSON);
+
+	double total = 0;
+	printf("corpus %s: %d files, %" PRIu64 " frames, %.2f MB, "
+	       "%.2f MB png\n",
+	       corpus, file_count, frame_count, file_size / 1e6,
+	       png_size / 1e6);
+	for (int p = 0; p < PHASE_COUNT; p++) {
+		printf("corpus %s: %-8s best of %d: %.3f ms, %.0f files/s\n",
+		       corpus, phase_names[p], reps, best[p] * 1e3,
+		       file_count / best[p]);
+		total += best[p];
+	}
+	printf("corpus %s: total    best of %d: %.3f ms, %.0f files/s\n",
+	       corpus, reps, total * 1e3, file_count / total);
+	return 0;
+}
+
+int compare_strings(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Benchmarks every bgf in a resource directory, in name order.
+ * return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int bench_directory(const char *dir_name, int reps)
+{
+	DIR *dir = opendir(dir_name);
+
+	if (!dir) {
+		fprintf(stderr, "Error: Failed to open directory %s: %s\n",
+			dir_name, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	char **files = NULL;
+	int file_count = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		const char *dot = strrchr(entry->d_name, '.');
+		if (!dot || strcasecmp(dot, ".bgf") != 0)
+			continue;
+		size_t len = strlen(dir_name) + strlen(entry->d_name) + 2;
+		files = realloc(files, sizeof(char *) * (file_count + 1));
+		files[file_count] = malloc(len);
+		snprintf(files[file_count], len, "%s/%s", dir_name,
+			 entry->d_name);
+		file_count++;
+	}
+	closedir(dir);
+
+	int result = EXIT_SUCCESS;
+	if (file_count == 0) {
+		fprintf(stderr, "Error: No bgf files in %s\n", dir_name);
+		result = EXIT_FAILURE;
+	} else {
+		qsort(files, file_count, sizeof(char *), compare_strings);
+		if (bench_corpus(dir_name, files, file_count, reps))
+			result = EXIT_FAILURE;
+	}
+
+	for (int i = 0; i < file_count; i++)
+		free(files[i]);
+	free(files);
+	return result;
+}
+
+/* Writes CORPUS_COPIES files of every corpus profile and benchmarks them as
+ * one corpus.
+ * return 0 on success, -1 on error
+ */
+int bench_synthetic_corpus(int reps)
+{
+	int file_count = CORPUS_PROFILE_COUNT * CORPUS_COPIES;
+	char **files = malloc(sizeof(char *) * file_count);
+	int written = 0;
+	int result = 0;
+
+	for (int p = 0; p < CORPUS_PROFILE_COUNT && result == 0; p++) {
+		for (int c = 0; c < CORPUS_COPIES && result == 0; c++) {
+			files[written] = malloc(64);
+			snprintf(files[written], 64, "bgf_bench_%s_%d.bgf",
+				 corpus_profiles[p].name, c);
+			result = write_synthetic_bgf(files[written],
+						     corpus_profiles + p);
+			written++;
+		}
+	}
+
+	if (result == 0)
+		result = bench_corpus("synthetic", files, file_count, reps);
+
+	for (int i = 0; i < written; i++) {
+		remove(files[i]);
+		free(files[i]);
+	}
+	free(files);
+	return result;
+}
+
+int main(int argc, char **argv)
+{
+	struct stat st;
+
+	// a real resource directory is only converted, phase by phase
+	if (argc > 1 && stat(argv[1], &st) == 0 && S_ISDIR(st.st_mode)) {
+		int reps = argc > 2 ? atoi(argv[2]) : DEFAULT_REPS;
+		if (reps < 1) {
+			printf("Usage: %s <resource directory> "
+			       "[repetitions]\n",
+			       argv[0]);
+			return EXIT_FAILURE;
+		}
+		return bench_directory(argv[1], reps);
+	}
+
+	int frame_count = argc > 1 ? atoi(argv[1]) : DEFAULT_FRAMES;
+	int reps = argc > 2 ? atoi(argv[2]) : DEFAULT_REPS;
+
+	if (frame_count < 1 || reps < 1) {
+		printf("Usage: %s [frame count] [repetitions]\n"
+		       "       %s <resource directory> [repetitions]\n",
+		       argv[0], argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// frames like the original bench file, all in one group
+	struct corpus_profile parse_profile = {
+		"bgf_bench", frame_count, 16, 80, 0, 2, frame_count
+	};
+	if (write_synthetic_bgf(BENCH_FILE, &parse_profile))
+		return EXIT_FAILURE;
+
+	int core_count = sysconf(_SC_NPROCESSORS_ONLN);
+	int thread_counts[2] = { 1, core_count };
+
+	for (int t = 0; t < 2; t++) {
+		if (t == 1 && core_count <= 1)
+			break;
+
+		struct bgf bgf;
+		double best = 0;
+		size_t file_size = 0;
+		uint64_t inflated = 0;
+
+		// the first pass warms the page cache and is not counted
+		for (int r = -1; r < reps; r++) {
+			double start = now_seconds();
+			if (open_bgf(&bgf, BENCH_FILE) || load_bgf(&bgf) ||
+			    decode_bgf(&bgf, thread_counts[t])) {
+				fprintf(stderr, "Error: %s: %s\n", BENCH_FILE,
+					bgf_strerror(bgf.error));
+				free_bgf(&bgf);
+				remove(BENCH_FILE);
+				return EXIT_FAILURE;
+			}
+			double elapsed = now_seconds() - start;
+
+			file_size = bgf.size;
+			inflated = 0;
+			for (int i = 0; i < bgf.bitmap_count; i++)
+				inflated += (uint64_t)bgf.bitmaps[i].width *
+					    bgf.bitmaps[i].height;
+			free_bgf(&bgf);
+
+			if (r >= 0 && (best == 0 || elapsed < best))
+				best = elapsed;
+		}
+
+		if (t == 0)
+			printf("parse: %d frames, %.2f MB file, %.2f MB inflated\n",
+			       frame_count, file_size / 1e6, inflated / 1e6);
+		printf("parse: %d thread(s), best of %d: %.3f ms, %.1f MB/s "
+		       "file, %.1f MB/s inflated, %.0f frames/s\n",
+		       thread_counts[t], reps, best * 1e3,
+		       file_size / 1e6 / best, inflated / 1e6 / best,
+		       frame_count / best);
+	}
+
+	// png encoding of the frames one by one and of their packed atlas
+	struct bgf bgf;
+	struct atlas atlas = { 0 };
+	int encode_reps = reps < MAX_ENCODE_REPS ? reps : MAX_ENCODE_REPS;
+	int result = EXIT_SUCCESS;
+
+	if (open_bgf(&bgf, BENCH_FILE) || load_bgf(&bgf) ||
+	    decode_bgf(&bgf, core_count) ||
+	    pack_bitmaps(&bgf, &atlas, ATLAS_MAX_DIM, ATLAS_PAD, core_count)) {
+		if (bgf.error)
+			fprintf(stderr, "Error: %s: %s\n", BENCH_FILE,
+				bgf_strerror(bgf.error));
+		free_bgf(&bgf);
+		remove(BENCH_FILE);
+		return EXIT_FAILURE;
+	}
+	copy_bitmaps(&bgf, &atlas);
+
+	if (bench_encode("frames", bgf.bitmaps, bgf.bitmap_count, 1,
+			 encode_reps) ||
+	    bench_encode("atlas", atlas.pages, atlas.page_count, 1,
+			 encode_reps))
+		result = EXIT_FAILURE;
+
+	// large pages are deflated in bands, one per thread, and are read back
+	// to check the stitched stream even on a single core
+	int band_threads = core_count > 1 ? core_count : 2;
+	if (result == EXIT_SUCCESS &&
+	    bench_encode("atlas", atlas.pages, atlas.page_count, band_threads,
+			 encode_reps))
+		result = EXIT_FAILURE;
+
+	if (result == EXIT_SUCCESS)
+		bench_expand(&atlas, reps);
+
+	free_atlas(&atlas);
+	free_bgf(&bgf);
+	remove(BENCH_FILE);
+
+	if (result == EXIT_SUCCESS && bench_synthetic_corpus(reps))
+		result = EXIT_FAILURE;
+	return result;
+}
@@ -0,0 +1,34 @@
+#ifndef BYTES_H
+#define BYTES_H
+
+#include <stdint.h>
+
+/* Little endian integers as the dds, hit mask and delta files store them,
+ * defined here so every writer and reader shares them without linking to
+ * each other.
+ */
+static inline void put_u16(uint8_t *out, uint16_t value)
+{
+	out[0] = value;
+	out[1] = value >> 8;
+}
+
+static inline void put_u32(uint8_t *out, uint32_t value)
+{
+	out[0] = value;
+	out[1] = value >> 8;
+	out[2] = value >> 16;
+	out[3] = value >> 24;
+}
+
+static inline uint16_t get_u16(const uint8_t *in)
+{
+	return in[0] | in[1] << 8;
+}
+
+static inline uint32_t get_u32(const uint8_t *in)
+{
+	return in[0] | in[1] << 8 | in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+#endif
@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "zlib.h"
+#include "cache.h"
+
+/* A 64 bit FNV-1a over whole words, which is several times faster than the
+ * bytewise one on large files, along with a crc32 and the size. An unchanged
+ * input is only mistaken for a changed one if all three collide.
+ */
+void make_cache_key(const uint8_t *data, size_t size, struct cache_key *key)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i = 0;
+
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		hash = (hash ^ word) * 0x100000001b3ULL;
+	}
+	for (; i < size; i++)
+		hash = (hash ^ data[i]) * 0x100000001b3ULL;
+
+	key->hash = hash;
+	key->crc = crc32_z(0, data, size);
+	key->size = size;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct cache_entry *ea = a;
+	const struct cache_entry *eb = b;
+	return strcmp(ea->input, eb->input);
+}
+
+static void free_entry(struct cache_entry *entry)
+{
+	free(entry->input);
+	free(entry->options);
+	for (int i = 0; i < entry->output_count; i++)
+		free(entry->outputs[i]);
+	free(entry->outputs);
+}
+
+/* Splits the tab separated fields of a line in place, the last of max_fields
+ * fields keeps the rest of the line.
+ * return the number of fields
+ */
+static int split_fields(char *line, char **fields, int max_fields)
+{
+	int count = 0;
+
+	for (;;) {
+		fields[count++] = line;
+		if (count == max_fields)
+			break;
+		line = strchr(line, '\t');
+		if (!line)
+			break;
+		*line++ = '\0';
+	}
+
+	return count;
+}
+
+/* Parses a manifest line:
+ * <hash><crc> <size> <options> <input> <output count> <outputs>...
+ * with fields separated by tabs.
+ * return 0 on success, -1 if the line is malformed
+ */
+static int parse_entry(char *line, struct cache_entry *entry)
+{
+	char *fields[5];
+	uint64_t size;
+	int output_count;
+
+	if (split_fields(line, fields, 5) != 5 ||
+	    strlen(fields[0]) != 24 ||
+	    sscanf(fields[0], "%16" SCNx64 "%8" SCNx32, &entry->key.hash,
+		   &entry->key.crc) != 2 ||
+	    sscanf(fields[1], "%" SCNu64, &size) != 1)
+		return -1;
+
+	char *outputs = strchr(fields[4], '\t');
+	if (outputs)
+		*outputs++ = '\0';
+	output_count = atoi(fields[4]);
+	if (output_count < 0 || (output_count > 0 && !outputs))
+		return -1;
+
+	char **names = malloc(sizeof(char *) * (output_count + 1));
+	if (output_count > 0 &&
+	    split_fields(outputs, names, output_count) != output_count) {
+		free(names);
+		return -1;
+	}
+
+	entry->key.size = size;
+	entry->options = strdup(fields[2]);
+	entry->input = strdup(fields[3]);
+	entry->output_count = output_count;
+	entry->outputs = names;
+	for (int i = 0; i < output_count; i++)
+		names[i] = strdup(names[i]);
+	return 0;
+}
+
+static struct cache_entry *add_entry(struct cache *cache)
+{
+	if (cache->entry_count == cache->capacity) {
+		cache->capacity = cache->capacity ? cache->capacity * 2 : 256;
+		cache->entries = realloc(cache->entries,
+					 sizeof(*cache->entries) *
+						 cache->capacity);
+	}
+
+	struct cache_entry *entry = cache->entries + cache->entry_count++;
+	memset(entry, 0, sizeof(*entry));
+	return entry;
+}
+
+int load_cache(struct cache *cache, const char *file_name,
+	       const char *options)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->file_name = file_name;
+	cache->options = options;
+	pthread_mutex_init(&cache->lock, NULL);
+
+	FILE *fp = fopen(file_name, "r");
+
+	if (!fp) {
+		if (errno == ENOENT)
+			return 0;
+		fprintf(stderr, "Error: Failed to open cache %s: %s\n",
+			file_name, strerror(errno));
+		return -1;
+	}
+
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t length;
+	int line_number = 0;
+
+	while ((length = getline(&line, &line_size, fp)) != -1) {
+		line_number++;
+		if (length > 0 && line[length - 1] == '\n')
+			line[length - 1] = '\0';
+
+		// a manifest from another version is simply rebuilt
+		if (line_number == 1) {
+			if (strcmp(line, CACHE_HEADER) != 0)
+				break;
+			continue;
+		}
+
+		struct cache_entry entry = { 0 };
+		if (parse_entry(line, &entry)) {
+			fprintf(stderr, "Error: Bad line %d in cache %s\n",
+				line_number, file_name);
+			free(line);
+			fclose(fp);
+			free_cache(cache);
+			return -1;
+		}
+		*add_entry(cache) = entry;
+	}
+
+	free(line);
+	fclose(fp);
+
+	if (cache->entry_count > 0)
+		qsort(cache->entries, cache->entry_count,
+		      sizeof(*cache->entries), compare_entries);
+	cache->loaded_count = cache->entry_count;
+	return 0;
+}
+
+// return the entry of input, NULL if there is none, called under lock
+static struct cache_entry *find_entry(struct cache *cache, const char *input)
+{
+	struct cache_entry key = { 0 };
+	key.input = (char *)input;
+
+	if (cache->loaded_count > 0) {
+		struct cache_entry *entry =
+			bsearch(&key, cache->entries, cache->loaded_count,
+				sizeof(*cache->entries), compare_entries);
+		if (entry)
+			return entry;
+	}
+
+	// inputs new to this run are few and unsorted
+	for (int i = cache->loaded_count; i < cache->entry_count; i++) {
+		if (strcmp(cache->entries[i].input, input) == 0)
+			return cache->entries + i;
+	}
+
+	return NULL;
+}
+
+int is_cached(struct cache *cache, const char *input,
+	      const struct cache_key *key)
+{
+	pthread_mutex_lock(&cache->lock);
+	struct cache_entry *entry = find_entry(cache, input);
+	int result = entry && !entry->is_stale &&
+		     entry->key.hash == key->hash &&
+		     entry->key.crc == key->crc &&
+		     entry->key.size == key->size &&
+		     strcmp(entry->options, cache->options) == 0;
+
+	// outputs deleted since are written again, only their existence is
+	// checked, so outputs edited by hand are kept
+	for (int i = 0; result && i < entry->output_count; i++) {
+		struct stat st;
+		if (stat(entry->outputs[i], &st))
+			result = 0;
+	}
+
+	if (result)
+		cache->skipped_count++;
+	pthread_mutex_unlock(&cache->lock);
+
+	return result;
+}
+
+void update_cache(struct cache *cache, const char *input,
+		  const struct cache_key *key, char **outputs,
+		  int output_count)
+{
+	pthread_mutex_lock(&cache->lock);
+	struct cache_entry *entry = find_entry(cache, input);
+	if (entry) {
+		free_entry(entry);
+		memset(entry, 0, sizeof(*entry));
+	} else {
+		entry = add_entry(cache);
+	}
+
+	entry->input = strdup(input);
+	entry->key = *key;
+	entry->options = strdup(cache->options);
+	entry->output_count = output_count;
+	entry->outputs = malloc(sizeof(char *) * (output_count + 1));
+	for (int i = 0; i < output_count; i++)
+		entry->outputs[i] = strdup(outputs[i]);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void invalidate_cache(struct cache *cache, const char *input)
+{
+	pthread_mutex_lock(&cache->lock);
+	struct cache_entry *entry = find_entry(cache, input);
+	if (entry)
+		entry->is_stale = 1;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* Writes the manifest under a temporary name and renames it into place, so an
+ * interrupted run leaves the previous manifest intact.
+ */
+int save_cache(struct cache *cache)
+{
+	size_t temp_len = strlen(cache->file_name) + 32;
+	char *temp_name = malloc(temp_len);
+	snprintf(temp_name, temp_len, "%s.%ld.tmp", cache->file_name,
+		 (long)getpid());
+
+	FILE *fp = fopen(temp_name, "w");
+
+	if (!fp) {
+		fprintf(stderr, "Error: Failed to create cache %s: %s\n",
+			temp_name, strerror(errno));
+		free(temp_name);
+		return -1;
+	}
+
+	fprintf(fp, "%s\n", CACHE_HEADER);
+	for (int i = 0; i < cache->entry_count; i++) {
+		struct cache_entry *entry = cache->entries + i;
+		if (entry->is_stale)
+			continue;
+		fprintf(fp, "%016" PRIx64 "%08" PRIx32 "\t%" PRIu64 "\t%s\t%s\t%d",
+			entry->key.hash, entry->key.crc, entry->key.size,
+			entry->options, entry->input, entry->output_count);
+		for (int j = 0; j < entry->output_count; j++)
+			fprintf(fp, "\t%s", entry->outputs[j]);
+		fprintf(fp, "\n");
+	}
+
+	int result = 0;
+	if (fclose(fp) || rename(temp_name, cache->file_name)) {
+		fprintf(stderr, "Error: Failed to write cache %s: %s\n",
+			cache->file_name, strerror(errno));
+		remove(temp_name);
+		result = -1;
+	}
+
+	free(temp_name);
+	return result;
+}
+
+void free_cache(struct cache *cache)
+{
+	for (int i = 0; i < cache->entry_count; i++)
+		free_entry(cache->entries + i);
+	free(cache->entries);
+	pthread_mutex_destroy(&cache->lock);
+	memset(cache, 0, sizeof(*cache));
+}
@@ -0,0 +1,69 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <pthread.h>
+#include <inttypes.h>
+#include <stddef.h>
+
+// CONSTANTS
+// first line of a manifest, bumped when the line format changes
+#define CACHE_HEADER "bgf2png cache 1"
+
+// identifies the contents of an input file
+struct cache_key {
+	uint64_t hash;
+	uint32_t crc;
+	uint64_t size;
+};
+
+// one converted input: what it was converted from and what it produced
+struct cache_entry {
+	char *input;
+	struct cache_key key;
+	// tool version and every option that changes the outputs
+	char *options;
+	char **outputs;
+	int output_count;
+	// converting the input failed this run, drop it from the manifest
+	int is_stale;
+};
+
+/* A manifest of the outputs of earlier runs, loaded once and rewritten at the
+ * end of a run. Entries read from the file are kept sorted by input, and are
+ * only accessed under lock by the conversions running on several threads.
+ */
+struct cache {
+	const char *file_name;
+	const char *options;
+	struct cache_entry *entries;
+	int entry_count;
+	int capacity;
+	// entries of the loaded file, the sorted part of entries
+	int loaded_count;
+	int skipped_count;
+	pthread_mutex_t lock;
+};
+
+// hashes the contents of an input file
+void make_cache_key(const uint8_t *data, size_t size, struct cache_key *key);
+/* Loads the manifest in file_name, a missing file is an empty cache. options
+ * is recorded with every output converted this run.
+ * return 0 on success, -1 on error
+ */
+int load_cache(struct cache *cache, const char *file_name,
+	       const char *options);
+// return 1 if input was converted from key with the same options before and
+// all its outputs still exist, 0 if it has to be converted
+int is_cached(struct cache *cache, const char *input,
+	      const struct cache_key *key);
+// records the outputs of a successful conversion of input
+void update_cache(struct cache *cache, const char *input,
+		  const struct cache_key *key, char **outputs,
+		  int output_count);
+// drops input from the manifest after it failed to convert
+void invalidate_cache(struct cache *cache, const char *input);
+// replaces the manifest, return 0 on success, -1 on error
+int save_cache(struct cache *cache);
+void free_cache(struct cache *cache);
+
+#endif
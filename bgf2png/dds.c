@@ -0,0 +1,522 @@
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "palette.h"
+#include "mipmap.h"
+#include "dds.h"
+#include "bytes.h"
+
+// DDS header flags
+#define DDSD_CAPS 0x1
+#define DDSD_HEIGHT 0x2
+#define DDSD_WIDTH 0x4
+#define DDSD_PITCH 0x8
+#define DDSD_PIXELFORMAT 0x1000
+#define DDSD_MIPMAPCOUNT 0x20000
+#define DDSD_LINEARSIZE 0x80000
+#define DDPF_ALPHAPIXELS 0x1
+#define DDPF_FOURCC 0x4
+#define DDPF_RGB 0x40
+#define DDPF_LUMINANCE 0x20000
+#define DDSCAPS_COMPLEX 0x8
+#define DDSCAPS_TEXTURE 0x1000
+#define DDSCAPS_MIPMAP 0x400000
+#define DDS_HEADER_SIZE 128
+
+const char *dds_format_names[DDS_FORMAT_COUNT] = { "bc1", "bc3", "r8",
+						   "rgba" };
+
+int find_dds_format(const char *name)
+{
+	for (int i = 0; i < DDS_FORMAT_COUNT; i++) {
+		if (strcmp(name, dds_format_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/* Writes the "DDS " magic and the 124 byte header. size is the size of the
+ * whole top level for block formats and the size of its rows for the others.
+ */
+static void put_dds_header(uint8_t *out, int width, int height, int format,
+			   size_t size, int level_count)
+{
+	int is_block = format == DDS_BC1 || format == DDS_BC3;
+
+	memset(out, 0, DDS_HEADER_SIZE);
+	memcpy(out, "DDS ", 4);
+	put_u32(out + 4, 124);
+	put_u32(out + 8, DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH |
+				 DDSD_PIXELFORMAT |
+				 (is_block ? DDSD_LINEARSIZE : DDSD_PITCH) |
+				 (level_count > 1 ? DDSD_MIPMAPCOUNT : 0));
+	put_u32(out + 12, height);
+	put_u32(out + 16, width);
+	put_u32(out + 20, size);
+	if (level_count > 1)
+		put_u32(out + 28, level_count);
+	// pixel format starts at 76
+	put_u32(out + 76, 32);
+	if (is_block) {
+		put_u32(out + 80, DDPF_FOURCC);
+		memcpy(out + 84, format == DDS_BC1 ? "DXT1" : "DXT5", 4);
+	} else if (format == DDS_R8) {
+		put_u32(out + 80, DDPF_LUMINANCE);
+		put_u32(out + 88, 8);
+		put_u32(out + 92, 0xFF);
+	} else {
+		put_u32(out + 80, DDPF_RGB | DDPF_ALPHAPIXELS);
+		put_u32(out + 88, 32);
+		put_u32(out + 92, 0x000000FF);
+		put_u32(out + 96, 0x0000FF00);
+		put_u32(out + 100, 0x00FF0000);
+		put_u32(out + 104, 0xFF000000);
+	}
+	put_u32(out + 108, DDSCAPS_TEXTURE |
+				   (level_count > 1 ?
+					    DDSCAPS_COMPLEX | DDSCAPS_MIPMAP :
+					    0));
+}
+
+// return the number of bytes a width x height level takes in format
+static size_t level_size(int format, int width, int height)
+{
+	size_t blocks = (size_t)((width + 3) / 4) * ((height + 3) / 4);
+
+	switch (format) {
+	case DDS_BC1:
+		return blocks * 8;
+	case DDS_BC3:
+		return blocks * 16;
+	case DDS_R8:
+		return (size_t)width * height;
+	default:
+		return (size_t)width * height * 4;
+	}
+}
+
+/* Copies the 4x4 block at bx, by of an RGBA level. Blocks hanging over the
+ * right or bottom edge repeat the last column or row. With binary_alpha set,
+ * alpha is cut to 0 or 255 at one half, as BC1 can only store that.
+ * return the number of pixels that aren't fully transparent
+ */
+static int load_block(const struct mip_level *level, int bx, int by,
+		      int binary_alpha, uint8_t rgba[16][4])
+{
+	int opaque_count = 0;
+
+	for (int y = 0; y < 4; y++) {
+		int sy = by * 4 + y;
+		if (sy >= level->height)
+			sy = level->height - 1;
+		for (int x = 0; x < 4; x++) {
+			int sx = bx * 4 + x;
+			if (sx >= level->width)
+				sx = level->width - 1;
+			uint8_t *texel = rgba[y * 4 + x];
+			memcpy(texel,
+			       level->rgba + ((size_t)sy * level->width + sx) * 4,
+			       4);
+			if (binary_alpha)
+				texel[3] = texel[3] >= 128 ? 255 : 0;
+			opaque_count += texel[3] != 0;
+		}
+	}
+
+	return opaque_count;
+}
+
+static uint16_t pack_565(const float color[3])
+{
+	int r = color[0] * 31.0f / 255.0f + 0.5f;
+	int g = color[1] * 63.0f / 255.0f + 0.5f;
+	int b = color[2] * 31.0f / 255.0f + 0.5f;
+	r = r < 0 ? 0 : r > 31 ? 31 : r;
+	g = g < 0 ? 0 : g > 63 ? 63 : g;
+	b = b < 0 ? 0 : b > 31 ? 31 : b;
+	return r << 11 | g << 5 | b;
+}
+
+static void unpack_565(uint16_t packed, int color[3])
+{
+	int r = packed >> 11, g = (packed >> 5) & 63, b = packed & 31;
+	color[0] = r << 3 | r >> 2;
+	color[1] = g << 2 | g >> 4;
+	color[2] = b << 3 | b >> 2;
+}
+
+/* Picks two 565 endpoints for the opaque pixels of a block: the extremes of
+ * the pixels projected on the principal axis of their colors, found by a few
+ * power iterations on the covariance matrix.
+ */
+static void fit_endpoints(uint8_t rgba[16][4], uint16_t *c0, uint16_t *c1)
+{
+	float mean[3] = { 0 };
+	float cov[6] = { 0 };
+	int count = 0;
+
+	for (int i = 0; i < 16; i++) {
+		if (!rgba[i][3])
+			continue;
+		for (int c = 0; c < 3; c++)
+			mean[c] += rgba[i][c];
+		count++;
+	}
+	for (int c = 0; c < 3; c++)
+		mean[c] /= count;
+
+	for (int i = 0; i < 16; i++) {
+		if (!rgba[i][3])
+			continue;
+		float r = rgba[i][0] - mean[0];
+		float g = rgba[i][1] - mean[1];
+		float b = rgba[i][2] - mean[2];
+		cov[0] += r * r;
+		cov[1] += r * g;
+		cov[2] += r * b;
+		cov[3] += g * g;
+		cov[4] += g * b;
+		cov[5] += b * b;
+	}
+
+	float axis[3] = { 1, 1, 1 };
+	for (int iter = 0; iter < 8; iter++) {
+		float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+		float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+		float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+		float m = x * x > y * y ? x : y;
+		m = m * m > z * z ? m : z;
+		if (m == 0)
+			break;
+		axis[0] = x / m;
+		axis[1] = y / m;
+		axis[2] = z / m;
+	}
+
+	float min_dot = 0, max_dot = 0;
+	int min_i = -1, max_i = -1;
+	for (int i = 0; i < 16; i++) {
+		if (!rgba[i][3])
+			continue;
+		float dot = rgba[i][0] * axis[0] + rgba[i][1] * axis[1] +
+			    rgba[i][2] * axis[2];
+		if (min_i == -1 || dot < min_dot) {
+			min_dot = dot;
+			min_i = i;
+		}
+		if (max_i == -1 || dot > max_dot) {
+			max_dot = dot;
+			max_i = i;
+		}
+	}
+
+	float lo[3] = { rgba[min_i][0], rgba[min_i][1], rgba[min_i][2] };
+	float hi[3] = { rgba[max_i][0], rgba[max_i][1], rgba[max_i][2] };
+	*c0 = pack_565(hi);
+	*c1 = pack_565(lo);
+}
+
+/* Encodes the color half of a block. With punch_through set, transparent
+ * pixels use the fourth color of 3 color mode, which BC1 decodes as
+ * transparent black; otherwise the 4 color mode is used and transparent
+ * pixels take whichever color is nearest.
+ */
+static void encode_color_block(uint8_t rgba[16][4], int opaque_count,
+			       int punch_through, uint8_t out[8])
+{
+	uint16_t c0 = 0, c1 = 0;
+	uint32_t indexes = 0;
+
+	if (opaque_count > 0)
+		fit_endpoints(rgba, &c0, &c1);
+
+	int three_color = punch_through && opaque_count < 16;
+	// 3 color mode is chosen by c0 <= c1, 4 color mode by c0 > c1
+	if (three_color ? c0 > c1 : c0 < c1) {
+		uint16_t swap = c0;
+		c0 = c1;
+		c1 = swap;
+	}
+
+	int colors[4][3];
+	unpack_565(c0, colors[0]);
+	unpack_565(c1, colors[1]);
+	int color_count = three_color || c0 == c1 ? 3 : 4;
+	for (int c = 0; c < 3; c++) {
+		if (color_count == 3) {
+			colors[2][c] = (colors[0][c] + colors[1][c]) / 2;
+		} else {
+			colors[2][c] = (2 * colors[0][c] + colors[1][c]) / 3;
+			colors[3][c] = (colors[0][c] + 2 * colors[1][c]) / 3;
+		}
+	}
+
+	for (int i = 0; i < 16; i++) {
+		uint32_t best = 0;
+		if (three_color && !rgba[i][3]) {
+			best = 3;
+		} else {
+			int best_dist = -1;
+			for (int j = 0; j < color_count; j++) {
+				int dr = rgba[i][0] - colors[j][0];
+				int dg = rgba[i][1] - colors[j][1];
+				int db = rgba[i][2] - colors[j][2];
+				int dist = dr * dr + dg * dg + db * db;
+				if (best_dist == -1 || dist < best_dist) {
+					best_dist = dist;
+					best = j;
+				}
+			}
+		}
+		indexes |= best << (i * 2);
+	}
+
+	out[0] = c0;
+	out[1] = c0 >> 8;
+	out[2] = c1;
+	out[3] = c1 >> 8;
+	put_u32(out + 4, indexes);
+}
+
+/* Encodes alpha in 8 value mode between the block's largest and smallest
+ * alpha. Texels of the top level are only ever 0 or 255, which this stores
+ * exactly; filtered mip levels get the nearest of the 8 values.
+ */
+static void encode_alpha_block(uint8_t rgba[16][4], uint8_t out[8])
+{
+	int a0 = 0, a1 = 255;
+	uint64_t indexes = 0;
+
+	for (int i = 0; i < 16; i++) {
+		if (rgba[i][3] > a0)
+			a0 = rgba[i][3];
+		if (rgba[i][3] < a1)
+			a1 = rgba[i][3];
+	}
+
+	if (a0 > a1) {
+		int values[8] = { a0, a1 };
+		for (int j = 1; j < 7; j++)
+			values[j + 1] = ((7 - j) * a0 + j * a1) / 7;
+
+		for (int i = 0; i < 16; i++) {
+			int best = 0;
+			for (int j = 1; j < 8; j++) {
+				if (abs(rgba[i][3] - values[j]) <
+				    abs(rgba[i][3] - values[best]))
+					best = j;
+			}
+			indexes |= (uint64_t)best << (i * 3);
+		}
+	}
+
+	out[0] = a0;
+	out[1] = a1;
+	for (int i = 0; i < 6; i++)
+		out[2 + i] = indexes >> (i * 8);
+}
+
+// shared state of the threads encoding rows of blocks
+struct block_queue {
+	const struct mip_level *level;
+	int format;
+	int blocks_wide;
+	int blocks_high;
+	uint8_t *out;
+	int next_row;
+	pthread_mutex_t lock;
+};
+
+static void *block_worker(void *arg)
+{
+	struct block_queue *queue = arg;
+	int block_size = queue->format == DDS_BC1 ? 8 : 16;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		int by = queue->next_row++;
+		pthread_mutex_unlock(&queue->lock);
+
+		if (by >= queue->blocks_high)
+			break;
+
+		uint8_t *out = queue->out +
+			       (size_t)by * queue->blocks_wide * block_size;
+		for (int bx = 0; bx < queue->blocks_wide; bx++) {
+			uint8_t rgba[16][4];
+			int opaque_count =
+				load_block(queue->level, bx, by,
+					   queue->format == DDS_BC1, rgba);
+			if (queue->format == DDS_BC1) {
+				encode_color_block(rgba, opaque_count, 1, out);
+			} else {
+				encode_alpha_block(rgba, out);
+				encode_color_block(rgba, opaque_count, 0,
+						   out + 8);
+			}
+			out += block_size;
+		}
+	}
+
+	return NULL;
+}
+
+// compresses a level on thread_count threads, each taking rows of blocks
+static void encode_blocks(const struct mip_level *level, int format,
+			  int thread_count, uint8_t *out)
+{
+	struct block_queue queue = { 0 };
+
+	queue.level = level;
+	queue.format = format;
+	queue.blocks_wide = (level->width + 3) / 4;
+	queue.blocks_high = (level->height + 3) / 4;
+	queue.out = out;
+	pthread_mutex_init(&queue.lock, NULL);
+
+	if (thread_count > queue.blocks_high)
+		thread_count = queue.blocks_high;
+	if (thread_count <= 1) {
+		block_worker(&queue);
+	} else {
+		// whatever the threads that couldn't be started leave is
+		// compressed here
+		pthread_t *threads = malloc(sizeof(*threads) * thread_count);
+		int started = 0;
+		for (int i = 0; threads && i < thread_count; i++) {
+			if (pthread_create(&threads[started], NULL,
+					   block_worker, &queue) == 0)
+				started++;
+		}
+		if (started < thread_count)
+			block_worker(&queue);
+		for (int i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+		free(threads);
+	}
+	pthread_mutex_destroy(&queue.lock);
+}
+
+int encode_dds(const struct bitmap *bitmap, const struct dds_options *options,
+	       const struct mip_rect *rects, int rect_count, int thread_count,
+	       uint8_t **dds, size_t *dds_size)
+{
+	int format = options->format;
+
+	if (bitmap->width < 1 || bitmap->height < 1) {
+		fprintf(stderr, "Error: Can't compress an empty %dx%d image\n",
+			bitmap->width, bitmap->height);
+		return -1;
+	}
+
+	// without mipmaps the indexes are stored as they are
+	if (format == DDS_R8 && !options->mipmaps) {
+		size_t size = level_size(format, bitmap->width, bitmap->height);
+		uint8_t *out = malloc(DDS_HEADER_SIZE + size);
+		put_dds_header(out, bitmap->width, bitmap->height, format,
+			       bitmap->width, 1);
+		memcpy(out + DDS_HEADER_SIZE, bitmap->image_bytes, size);
+		*dds = out;
+		*dds_size = DDS_HEADER_SIZE + size;
+		return 0;
+	}
+
+	struct mip_level *levels;
+	int level_count = build_mipmaps(
+		bitmap, rects, rect_count,
+		format == DDS_RGBA && options->premultiply,
+		options->mipmaps ? 0 : 1, &levels);
+
+	size_t size = DDS_HEADER_SIZE;
+	for (int l = 0; l < level_count; l++)
+		size += level_size(format, levels[l].width, levels[l].height);
+
+	uint8_t *out = malloc(size);
+	int is_block = format == DDS_BC1 || format == DDS_BC3;
+	put_dds_header(out, bitmap->width, bitmap->height, format,
+		       is_block ? level_size(format, bitmap->width,
+					     bitmap->height) :
+				  (size_t)bitmap->width *
+					  (format == DDS_R8 ? 1 : 4),
+		       level_count);
+
+	// levels follow each other from the largest down
+	uint8_t *pos = out + DDS_HEADER_SIZE;
+	for (int l = 0; l < level_count; l++) {
+		struct mip_level *level = levels + l;
+		size_t bytes = level_size(format, level->width, level->height);
+		if (is_block)
+			encode_blocks(level, format, thread_count, pos);
+		else if (format == DDS_R8)
+			memcpy(pos, level->indexes, bytes);
+		else
+			memcpy(pos, level->rgba, bytes);
+		pos += bytes;
+	}
+
+	free_mipmaps(levels, level_count);
+	*dds = out;
+	*dds_size = size;
+	return 0;
+}
+
+// writes and frees a dds file held in memory
+static int save_dds(const char *file_name, uint8_t *dds, size_t dds_size)
+{
+	FILE *fp = fopen(file_name, "wb");
+
+	if (!fp) {
+		fprintf(stderr, "Error: Failed to create dds %s: %s\n",
+			file_name, strerror(errno));
+		free(dds);
+		return -1;
+	}
+
+	size_t written = fwrite(dds, 1, dds_size, fp);
+	free(dds);
+
+	if (fclose(fp) || written != dds_size) {
+		fprintf(stderr, "Error: Failed to write dds %s\n", file_name);
+		return -1;
+	}
+
+	return 0;
+}
+
+int write_dds(const char *file_name, const struct bitmap *bitmap,
+	      const struct dds_options *options, const struct mip_rect *rects,
+	      int rect_count, int thread_count)
+{
+	uint8_t *dds;
+	size_t dds_size;
+
+	if (encode_dds(bitmap, options, rects, rect_count, thread_count, &dds,
+		       &dds_size)) {
+		fprintf(stderr, "Error: Failed to encode dds %s\n", file_name);
+		return -1;
+	}
+
+	return save_dds(file_name, dds, dds_size);
+}
+
+/* Shaders sampling an R8 texture look its indexes up in this 256x1 texture,
+ * which holds the palette with TRANSPARENT_INDEX at alpha 0.
+ */
+int write_palette_dds(const char *file_name)
+{
+	uint8_t indexes[256];
+	uint32_t lut[256];
+	size_t dds_size = DDS_HEADER_SIZE + sizeof(indexes) * 4;
+	uint8_t *dds = malloc(dds_size);
+
+	for (int i = 0; i < 256; i++)
+		indexes[i] = i;
+
+	make_rgba_lut(lut, 0);
+	put_dds_header(dds, 256, 1, DDS_RGBA, sizeof(indexes) * 4, 1);
+	expand_indexes(lut, indexes, 256, dds + DDS_HEADER_SIZE);
+	return save_dds(file_name, dds, dds_size);
+}
@@ -0,0 +1,49 @@
+#ifndef DDS_H
+#define DDS_H
+
+#include <stddef.h>
+#include "bgf.h"
+#include "mipmap.h"
+
+// CONSTANTS
+/* BC1 with 1 bit alpha for TRANSPARENT_INDEX, BC3 with a separate alpha block,
+ * the palette indexes themselves as an 8 bit single channel texture, or
+ * uncompressed RGBA8
+ */
+#define DDS_BC1 0
+#define DDS_BC3 1
+#define DDS_R8 2
+#define DDS_RGBA 3
+#define DDS_FORMAT_COUNT 4
+// file written next to R8 textures, the palette as a 256x1 RGBA texture
+#define DDS_PALETTE_FILE "palette.dds"
+
+extern const char *dds_format_names[DDS_FORMAT_COUNT];
+
+struct dds_options {
+	// one of the DDS_ formats
+	int format;
+	// zero the color of transparent texels in RGBA textures
+	int premultiply;
+	// store the whole mip chain after the top level
+	int mipmaps;
+};
+
+// return the format called name, -1 if there is none
+int find_dds_format(const char *name);
+/* Encodes a palette bitmap as a dds texture in a malloced buffer, blocks are
+ * compressed on thread_count threads. rects are the sprites mip levels are
+ * filtered within, NULL if the bitmap is a single image.
+ * return 0 on success, -1 on error
+ */
+int encode_dds(const struct bitmap *bitmap, const struct dds_options *options,
+	       const struct mip_rect *rects, int rect_count, int thread_count,
+	       uint8_t **dds, size_t *dds_size);
+// return 0 on success, -1 on error
+int write_palette_dds(const char *file_name);
+// return 0 on success, -1 on error
+int write_dds(const char *file_name, const struct bitmap *bitmap,
+	      const struct dds_options *options, const struct mip_rect *rects,
+	      int rect_count, int thread_count);
+
+#endif
@@ -0,0 +1,427 @@
+#include <stdlib.h>
+#include <string.h>
+#include "delta.h"
+#include "bytes.h"
+
+// growing buffer the frame data is encoded into
+struct delta_buffer {
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+};
+
+// return a pointer to length more bytes at the end of buffer, NULL if out of
+// memory
+static uint8_t *grow_delta_buffer(struct delta_buffer *buffer, size_t length)
+{
+	if (buffer->size + length > buffer->capacity) {
+		size_t capacity = buffer->capacity ? buffer->capacity * 2 :
+						     4096;
+		while (capacity < buffer->size + length)
+			capacity *= 2;
+		uint8_t *data = realloc(buffer->data, capacity);
+		if (!data)
+			return NULL;
+		buffer->data = data;
+		buffer->capacity = capacity;
+	}
+
+	buffer->size += length;
+	return buffer->data + buffer->size - length;
+}
+
+// a rectangle of changed pixels, in pixels
+struct delta_rect {
+	int x, y;
+	int width, height;
+};
+
+/* Finds the tiles of frame that differ from previous and merges them into
+ * rects, first runs of tiles along a row of tiles and then runs spanning the
+ * same columns on consecutive rows.
+ * return the number of rects
+ */
+static int find_dirty_rects(const uint8_t *previous, const uint8_t *frame,
+			    int width, int height, struct delta_rect *rects)
+{
+	int rect_count = 0;
+	// rects of the row of tiles above start here
+	int above = 0;
+
+	for (int y = 0; y < height; y += DELTA_TILE) {
+		int tile_height = height - y < DELTA_TILE ? height - y :
+							    DELTA_TILE;
+		int row_start = rect_count;
+
+		for (int x = 0; x < width;) {
+			int x0 = x;
+			// extend the run while tiles keep changing
+			while (x < width) {
+				int tile_width = width - x < DELTA_TILE ?
+							 width - x :
+							 DELTA_TILE;
+				int is_dirty = 0;
+				for (int r = 0; r < tile_height && !is_dirty;
+				     r++) {
+					size_t i = (size_t)(y + r) * width + x;
+					is_dirty = memcmp(previous + i,
+							  frame + i,
+							  tile_width) != 0;
+				}
+				if (!is_dirty)
+					break;
+				x += tile_width;
+			}
+
+			if (x == x0) {
+				x += DELTA_TILE;
+				continue;
+			}
+
+			struct delta_rect *merged = NULL;
+			for (int i = above; i < row_start && !merged; i++) {
+				if (rects[i].x == x0 &&
+				    rects[i].width == x - x0 &&
+				    rects[i].y + rects[i].height == y)
+					merged = rects + i;
+			}
+
+			if (merged) {
+				merged->height += tile_height;
+			} else {
+				struct delta_rect *rect = rects + rect_count++;
+				rect->x = x0;
+				rect->y = y;
+				rect->width = x - x0;
+				rect->height = tile_height;
+			}
+		}
+
+		// rects that didn't reach the bottom of this row are done, they
+		// go in front of the ones the next row may still extend
+		for (int i = above; i < rect_count; i++) {
+			if (rects[i].y + rects[i].height != y + tile_height) {
+				struct delta_rect swap = rects[above];
+				rects[above++] = rects[i];
+				rects[i] = swap;
+			}
+		}
+	}
+
+	return rect_count;
+}
+
+// return the size of the data of a delta with these rects
+static size_t delta_data_size(const struct delta_rect *rects, int rect_count)
+{
+	size_t size = 4;
+	for (int i = 0; i < rect_count; i++)
+		size += 8 + (size_t)rects[i].width * rects[i].height;
+	return size;
+}
+
+/* Appends frame index to the frame data and fills its entry in the table,
+ * as a delta against frame *reference if that is smaller than its delta
+ * against a transparent frame. *reference is then set to the frame it was
+ * stored against, -1 for the transparent frame.
+ * return 0 on success, -1 if out of memory
+ */
+static int put_delta_frame(struct delta_buffer *buffer, const struct bgf *bgf,
+			   int index, int *stored_reference,
+			   const uint8_t *transparent, struct delta_rect *rects)
+{
+	int reference = *stored_reference;
+	const struct bitmap *bm = bgf->bitmaps + index;
+	size_t table_size = DELTA_HEADER_SIZE +
+			    (size_t)bgf->bitmap_count * DELTA_FRAME_SIZE;
+	int rect_count = find_dirty_rects(transparent, bm->image_bytes,
+					  bm->width, bm->height, rects);
+	size_t data_size = delta_data_size(rects, rect_count);
+
+	if (reference >= 0) {
+		const struct bitmap *ref = bgf->bitmaps + reference;
+		int ref_count = 0;
+		size_t ref_size = data_size;
+		if (ref->width == bm->width && ref->height == bm->height) {
+			ref_count = find_dirty_rects(ref->image_bytes,
+						     bm->image_bytes, bm->width,
+						     bm->height, rects);
+			ref_size = delta_data_size(rects, ref_count);
+		}
+		if (ref_size < data_size) {
+			rect_count = ref_count;
+			data_size = ref_size;
+		} else {
+			reference = -1;
+			rect_count = find_dirty_rects(transparent,
+						      bm->image_bytes,
+						      bm->width, bm->height,
+						      rects);
+		}
+	}
+
+	uint8_t *entry = buffer->data + DELTA_HEADER_SIZE +
+			 (size_t)index * DELTA_FRAME_SIZE;
+	put_u32(entry, bm->width);
+	put_u32(entry + 4, bm->height);
+	put_u32(entry + 8, reference >= 0 ? reference : DELTA_TRANSPARENT);
+	put_u32(entry + 12, buffer->size - table_size);
+	put_u32(entry + 16, data_size);
+
+	uint8_t *out = grow_delta_buffer(buffer, data_size);
+	if (!out)
+		return -1;
+	put_u32(out, rect_count);
+	out += 4;
+	for (int r = 0; r < rect_count; r++) {
+		const struct delta_rect *rect = rects + r;
+		put_u16(out, rect->x);
+		put_u16(out + 2, rect->y);
+		put_u16(out + 4, rect->width);
+		put_u16(out + 6, rect->height);
+		out += 8;
+		for (int y = rect->y; y < rect->y + rect->height; y++) {
+			memcpy(out,
+			       bm->image_bytes + (size_t)y * bm->width +
+				       rect->x,
+			       rect->width);
+			out += rect->width;
+		}
+	}
+
+	*stored_reference = reference;
+	return 0;
+}
+
+/* Frames are visited in group order, so each delta applies to a frame that
+ * was already encoded. A frame in several groups is only stored for the first
+ * one, and frames in no group are stored against a transparent frame at the
+ * end. chains holds the deltas since a transparent frame of every frame, -1
+ * until it is stored.
+ * return 0 on success, -1 if out of memory
+ */
+static int put_delta_frames(struct delta_buffer *buffer, const struct bgf *bgf,
+			    int *chains, const uint8_t *transparent,
+			    struct delta_rect *rects)
+{
+	int frame_count = bgf->bitmap_count;
+	int offset = 0;
+
+	for (int g = 0; g < bgf->group_count; g++) {
+		const uint32_t *indexes = bgf->bitmap_indexes + offset;
+		int previous = -1;
+
+		for (int j = 0; j < bgf->bitmap_groups[g]; j++) {
+			int index = indexes[j];
+			if (index >= frame_count)
+				continue;
+
+			if (chains[index] == -1) {
+				int reference = previous;
+				if (reference >= 0 &&
+				    chains[reference] >= DELTA_MAX_CHAIN)
+					reference = -1;
+				if (put_delta_frame(buffer, bgf, index,
+						    &reference, transparent,
+						    rects))
+					return -1;
+				chains[index] = reference >= 0 ?
+							chains[reference] + 1 :
+							0;
+			}
+			previous = index;
+		}
+		offset += bgf->bitmap_groups[g];
+	}
+
+	for (int i = 0; i < frame_count; i++) {
+		int reference = -1;
+		if (chains[i] == -1 &&
+		    put_delta_frame(buffer, bgf, i, &reference, transparent,
+				    rects))
+			return -1;
+	}
+
+	return 0;
+}
+
+int encode_deltas(const struct bgf *bgf, uint8_t **deltas, size_t *size)
+{
+	int frame_count = bgf->bitmap_count;
+	size_t table_size = DELTA_HEADER_SIZE +
+			    (size_t)frame_count * DELTA_FRAME_SIZE;
+	struct delta_buffer buffer = { 0 };
+	size_t max_size = 1;
+	int max_tiles = 1;
+
+	for (int i = 0; i < frame_count; i++) {
+		const struct bitmap *bm = bgf->bitmaps + i;
+		size_t frame_size = (size_t)bm->width * bm->height;
+		int tiles = ((bm->width + DELTA_TILE - 1) / DELTA_TILE) *
+			    ((bm->height + DELTA_TILE - 1) / DELTA_TILE);
+		// rects only hold 16 bit coordinates
+		if (!bm->image_bytes || bm->is_trimmed || bm->width > 0xFFFF ||
+		    bm->height > 0xFFFF)
+			return -1;
+		if (frame_size > max_size)
+			max_size = frame_size;
+		if (tiles > max_tiles)
+			max_tiles = tiles;
+	}
+
+	int *chains = malloc(sizeof(int) * (frame_count + 1));
+	struct delta_rect *rects = malloc(sizeof(*rects) * max_tiles);
+	uint8_t *transparent = malloc(max_size);
+	int result = -1;
+
+	if (chains && rects && transparent &&
+	    grow_delta_buffer(&buffer, table_size)) {
+		memset(transparent, TRANSPARENT_INDEX, max_size);
+		for (int i = 0; i < frame_count; i++)
+			chains[i] = -1;
+		memset(buffer.data, 0, table_size);
+		result = put_delta_frames(&buffer, bgf, chains, transparent,
+					  rects);
+	}
+
+	if (result == 0) {
+		memcpy(buffer.data, DELTA_MAGIC, 4);
+		put_u32(buffer.data + 4, DELTA_VERSION);
+		put_u32(buffer.data + 8, frame_count);
+		put_u32(buffer.data + 12, buffer.size - table_size);
+		*deltas = buffer.data;
+		*size = buffer.size;
+	} else {
+		free(buffer.data);
+	}
+
+	free(chains);
+	free(rects);
+	free(transparent);
+	return result;
+}
+
+/* Checks the header and the table entry of frame index.
+ * return a pointer to the entry, NULL if the data is malformed
+ */
+static const uint8_t *find_delta_entry(const uint8_t *deltas, size_t size,
+				       int index)
+{
+	if (size < DELTA_HEADER_SIZE || memcmp(deltas, DELTA_MAGIC, 4) != 0 ||
+	    get_u32(deltas + 4) != DELTA_VERSION)
+		return NULL;
+
+	uint32_t frame_count = get_u32(deltas + 8);
+	size_t table_size = DELTA_HEADER_SIZE +
+			    (size_t)frame_count * DELTA_FRAME_SIZE;
+	if (index < 0 || index >= frame_count || table_size > size)
+		return NULL;
+
+	const uint8_t *entry = deltas + DELTA_HEADER_SIZE +
+			       (size_t)index * DELTA_FRAME_SIZE;
+	uint64_t end = (uint64_t)get_u32(entry + 12) + get_u32(entry + 16);
+	if (end > size - table_size)
+		return NULL;
+
+	return entry;
+}
+
+int delta_frame_info(const uint8_t *deltas, size_t size, int index,
+		     int *width, int *height, int *reference)
+{
+	const uint8_t *entry = find_delta_entry(deltas, size, index);
+
+	if (!entry)
+		return -1;
+
+	uint32_t ref = get_u32(entry + 8);
+	*width = get_u32(entry);
+	*height = get_u32(entry + 4);
+	*reference = ref == DELTA_TRANSPARENT ? -1 : (int)ref;
+	return 0;
+}
+
+int apply_delta_frame(const uint8_t *deltas, size_t size, int index,
+		      uint8_t *dest, int stride)
+{
+	const uint8_t *entry = find_delta_entry(deltas, size, index);
+
+	if (!entry)
+		return -1;
+
+	uint32_t frame_count = get_u32(deltas + 8);
+	uint32_t width = get_u32(entry);
+	uint32_t height = get_u32(entry + 4);
+	uint32_t reference = get_u32(entry + 8);
+	uint32_t data_size = get_u32(entry + 16);
+	const uint8_t *data = deltas + DELTA_HEADER_SIZE +
+			      (size_t)frame_count * DELTA_FRAME_SIZE +
+			      get_u32(entry + 12);
+
+	// frames not stored against another one start out transparent
+	if (reference == DELTA_TRANSPARENT) {
+		for (uint32_t y = 0; y < height; y++)
+			memset(dest + (size_t)y * stride, TRANSPARENT_INDEX,
+			       width);
+	}
+
+	if (data_size < 4)
+		return -1;
+
+	uint32_t rect_count = get_u32(data);
+	const uint8_t *end = data + data_size;
+	data += 4;
+	for (uint32_t r = 0; r < rect_count; r++) {
+		if (end - data < 8)
+			return -1;
+		int x = get_u16(data);
+		int y = get_u16(data + 2);
+		int w = get_u16(data + 4);
+		int h = get_u16(data + 6);
+		data += 8;
+		if (x + w > width || y + h > height ||
+		    end - data < (ptrdiff_t)w * h)
+			return -1;
+		for (int row = 0; row < h; row++)
+			memcpy(dest + (size_t)(y + row) * stride + x,
+			       data + (size_t)row * w, w);
+		data += (size_t)w * h;
+	}
+
+	return 0;
+}
+
+/* Follows the references back to a transparent frame, at most DELTA_MAX_CHAIN
+ * deltas away, and applies the deltas from there on in order
+ */
+int decode_delta_frame(const uint8_t *deltas, size_t size, int index,
+		       uint8_t *dest, int stride)
+{
+	int chain[DELTA_MAX_CHAIN + 1];
+	int length = 0;
+	int width, height, reference;
+
+	if (delta_frame_info(deltas, size, index, &width, &height,
+			     &reference))
+		return -1;
+
+	chain[length++] = index;
+	while (reference >= 0) {
+		int ref_width, ref_height;
+		if (length == DELTA_MAX_CHAIN + 1 ||
+		    delta_frame_info(deltas, size, reference, &ref_width,
+				     &ref_height, &index) ||
+		    ref_width != width || ref_height != height)
+			return -1;
+		chain[length++] = reference;
+		reference = index;
+	}
+
+	while (length > 0) {
+		if (apply_delta_frame(deltas, size, chain[--length], dest,
+				      stride))
+			return -1;
+	}
+
+	return 0;
+}
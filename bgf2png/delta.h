@@ -0,0 +1,49 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <inttypes.h>
+#include "bgf.h"
+
+// CONSTANTS
+#define DELTA_MAGIC "BGFD"
+#define DELTA_VERSION 1
+// magic, version, frame count and size of the frame data
+#define DELTA_HEADER_SIZE 16
+// width, height, reference, offset and size of the frame data
+#define DELTA_FRAME_SIZE 20
+// reference of a frame stored against a transparent frame
+#define DELTA_TRANSPARENT 0xFFFFFFFF
+// side of the square tiles frames are compared in
+#define DELTA_TILE 4
+// longest run of deltas before a frame starts from a transparent one again
+#define DELTA_MAX_CHAIN 16
+
+/* Encodes every decoded frame of a bgf into a malloced buffer. Every frame is
+ * stored as rectangles of the tiles that differ from a reference frame: the
+ * frame before it in its group if that has the same size and gives the
+ * smaller delta, a transparent frame otherwise.
+ * return 0 on success, -1 if a frame isn't decoded, is trimmed or too large,
+ * or memory runs out
+ */
+int encode_deltas(const struct bgf *bgf, uint8_t **deltas, size_t *size);
+/* Looks up the size of frame index and the frame its delta applies to, which
+ * is -1 for a frame stored against a transparent frame.
+ * return 0 on success, -1 if the data is malformed
+ */
+int delta_frame_info(const uint8_t *deltas, size_t size, int index,
+		     int *width, int *height, int *reference);
+/* Applies the delta of frame index to dest, which has to hold its reference
+ * frame unless it is stored against a transparent frame.
+ * return 0 on success, -1 if the data is malformed
+ */
+int apply_delta_frame(const uint8_t *deltas, size_t size, int index,
+		      uint8_t *dest, int stride);
+/* Rebuilds frame index into dest from the first frame of its chain of
+ * references, applying at most DELTA_MAX_CHAIN deltas.
+ * return 0 on success, -1 if the data is malformed
+ */
+int decode_delta_frame(const uint8_t *deltas, size_t size, int index,
+		       uint8_t *dest, int stride);
+
+#endif
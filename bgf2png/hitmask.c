@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "hitmask.h"
+#include "bytes.h"
+
+// return the pixels of a frame and the distance between their rows
+static const uint8_t *frame_pixels(const struct bitmap *bm,
+				   const struct atlas *atlas, int *stride)
+{
+	if (bm->image_bytes) {
+		*stride = bm->width;
+		return bm->image_bytes;
+	}
+
+	const struct bitmap *page = atlas->pages + bm->page;
+	*stride = page->width;
+	return page->image_bytes + (size_t)bm->y_pos * page->width + bm->x_pos;
+}
+
+/* Sets a bit in out for every opaque pixel of row. The lowest bit comes first,
+ * which is the order movemask puts 16 compared pixels in where SSE2 is
+ * available.
+ */
+static void pack_mask_row(const uint8_t *row, int width, uint8_t *out)
+{
+	int x = 0;
+
+#ifdef __SSE2__
+	const __m128i transparent = _mm_set1_epi8((char)TRANSPARENT_INDEX);
+	for (; x + 16 <= width; x += 16) {
+		__m128i pixels = _mm_loadu_si128((const __m128i *)(row + x));
+		int mask =
+			~_mm_movemask_epi8(_mm_cmpeq_epi8(pixels, transparent));
+		out[x / 8] = mask;
+		out[x / 8 + 1] = mask >> 8;
+	}
+#endif
+
+	for (; x < width; x++) {
+		if (row[x] != TRANSPARENT_INDEX)
+			out[x / 8] |= 1 << (x % 8);
+	}
+}
+
+/* Returns the index of the earlier frame of bgf that frame i duplicates, or -1
+ * if there is none. In a shared atlas the original can belong to another bgf,
+ * which isn't in this mask, so the pointer is only turned into an index once
+ * it is known to point into this bgf's bitmaps.
+ */
+static int find_mask_original(const struct bgf *bgf, int i)
+{
+	uintptr_t original = (uintptr_t)bgf->bitmaps[i].duplicate_of;
+	uintptr_t first = (uintptr_t)bgf->bitmaps;
+	uintptr_t end = (uintptr_t)(bgf->bitmaps + bgf->bitmap_count);
+
+	if (original < first || original >= end)
+		return -1;
+
+	int j = bgf->bitmaps[i].duplicate_of - bgf->bitmaps;
+	return j < i ? j : -1;
+}
+
+/* Bounds are found with the same scan --trim uses. Duplicates found by --dedup
+ * have the same pixels as the frame they match, so they share its mask rows.
+ * Duplicates of a frame in another bgf get rows of their own.
+ */
+void build_hitmask(const struct bgf *bgf, const struct atlas *atlas,
+		   struct hitmask *mask)
+{
+	memset(mask, 0, sizeof(*mask));
+	mask->frame_count = bgf->bitmap_count;
+	mask->frames = calloc(bgf->bitmap_count ? bgf->bitmap_count : 1,
+			      sizeof(*mask->frames));
+
+	// bounds first, so the rows of every frame fit in one allocation
+	for (int i = 0; i < bgf->bitmap_count; i++) {
+		const struct bitmap *bm = bgf->bitmaps + i;
+		struct frame_mask *frame = mask->frames + i;
+		const uint8_t *pixels;
+		int stride;
+
+		frame->width = bm->is_trimmed ? bm->source_width : bm->width;
+		frame->height = bm->is_trimmed ? bm->source_height : bm->height;
+		if (bm->width == 0 || bm->height == 0)
+			continue;
+
+		pixels = frame_pixels(bm, atlas, &stride);
+		if (find_opaque_bounds(pixels, bm->width, bm->height, stride,
+				       &frame->x0, &frame->y0, &frame->x1,
+				       &frame->y1))
+			continue;
+
+		int j = find_mask_original(bgf, i);
+		if (j >= 0) {
+			frame->offset = mask->frames[j].offset;
+		} else {
+			frame->offset = mask->rows_size;
+			mask->rows_size += (size_t)(frame->x1 - frame->x0 + 7) /
+					   8 * (frame->y1 - frame->y0);
+		}
+	}
+
+	mask->rows = calloc(mask->rows_size ? mask->rows_size : 1, 1);
+
+	for (int i = 0; i < bgf->bitmap_count; i++) {
+		const struct bitmap *bm = bgf->bitmaps + i;
+		struct frame_mask *frame = mask->frames + i;
+		int j = find_mask_original(bgf, i);
+		int width = frame->x1 - frame->x0;
+		int row_size = (width + 7) / 8;
+		const uint8_t *pixels;
+		int stride;
+
+		if (width == 0 || j >= 0)
+			continue;
+
+		pixels = frame_pixels(bm, atlas, &stride);
+		for (int y = frame->y0; y < frame->y1; y++)
+			pack_mask_row(pixels + (size_t)y * stride + frame->x0,
+				      width,
+				      mask->rows + frame->offset +
+					      (size_t)(y - frame->y0) *
+						      row_size);
+	}
+
+	// bounds go out in the coordinates of the untrimmed frame
+	for (int i = 0; i < bgf->bitmap_count; i++) {
+		const struct bitmap *bm = bgf->bitmaps + i;
+		struct frame_mask *frame = mask->frames + i;
+
+		if (!bm->is_trimmed || frame->x1 == frame->x0)
+			continue;
+		frame->x0 += bm->trim_x;
+		frame->x1 += bm->trim_x;
+		frame->y0 += bm->trim_y;
+		frame->y1 += bm->trim_y;
+	}
+}
+
+/* The header and a table of every frame are little endian 32 bit fields,
+ * followed by the mask rows of all frames.
+ */
+int write_hitmask(const char *file_name, const struct hitmask *mask)
+{
+	size_t table_size = HITMASK_HEADER_SIZE +
+			    (size_t)mask->frame_count * HITMASK_FRAME_SIZE;
+	uint8_t *table = malloc(table_size);
+
+	memcpy(table, HITMASK_MAGIC, 4);
+	put_u32(table + 4, HITMASK_VERSION);
+	put_u32(table + 8, mask->frame_count);
+	put_u32(table + 12, mask->rows_size);
+	for (int i = 0; i < mask->frame_count; i++) {
+		const struct frame_mask *frame = mask->frames + i;
+		uint8_t *out = table + HITMASK_HEADER_SIZE +
+			       (size_t)i * HITMASK_FRAME_SIZE;
+		put_u32(out, frame->width);
+		put_u32(out + 4, frame->height);
+		put_u32(out + 8, frame->x0);
+		put_u32(out + 12, frame->y0);
+		put_u32(out + 16, frame->x1);
+		put_u32(out + 20, frame->y1);
+		put_u32(out + 24, frame->offset);
+	}
+
+	FILE *fp = fopen(file_name, "wb");
+
+	if (!fp) {
+		fprintf(stderr, "Error: Failed to create hit mask %s: %s\n",
+			file_name, strerror(errno));
+		free(table);
+		return -1;
+	}
+
+	size_t written = fwrite(table, 1, table_size, fp);
+	written += fwrite(mask->rows, 1, mask->rows_size, fp);
+	free(table);
+
+	if (fclose(fp) || written != table_size + mask->rows_size) {
+		fprintf(stderr, "Error: Failed to write hit mask %s\n",
+			file_name);
+		return -1;
+	}
+
+	return 0;
+}
+
+void free_hitmask(struct hitmask *mask)
+{
+	free(mask->frames);
+	free(mask->rows);
+	memset(mask, 0, sizeof(*mask));
+}
+
+int export_hitmask(const struct bgf *bgf, const struct atlas *atlas,
+		   const char *file_name)
+{
+	struct hitmask mask;
+
+	build_hitmask(bgf, atlas, &mask);
+	int result = write_hitmask(file_name, &mask);
+	free_hitmask(&mask);
+	return result;
+}
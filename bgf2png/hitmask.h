@@ -0,0 +1,47 @@
+#ifndef HITMASK_H
+#define HITMASK_H
+
+#include <stddef.h>
+#include "bgf.h"
+#include "atlas.h"
+
+// CONSTANTS
+#define HITMASK_MAGIC "BGFH"
+#define HITMASK_VERSION 1
+// magic, version, frame count and size of the mask rows
+#define HITMASK_HEADER_SIZE 16
+// width, height, x0, y0, x1, y1 and offset of the mask rows
+#define HITMASK_FRAME_SIZE 28
+
+/* Opacity of one frame, in the coordinates of the width x height frame stored
+ * in the bgf. Every pixel outside the opaque bounds x0, y0 to x1, y1 (x1 and
+ * y1 exclusive) is transparent, the pixels inside are one bit each, rows of
+ * (x1 - x0 + 7) / 8 bytes starting offset bytes into the mask rows, leftmost
+ * pixel in the lowest bit. A fully transparent frame has empty bounds at 0, 0.
+ */
+struct frame_mask {
+	int width, height;
+	int x0, y0, x1, y1;
+	size_t offset;
+};
+
+struct hitmask {
+	int frame_count;
+	struct frame_mask *frames;
+	uint8_t *rows;
+	size_t rows_size;
+};
+
+/* Builds the mask of every frame of a decoded bgf, from the frames' own pixels
+ * or from their place in atlas where they were decoded straight into it
+ */
+void build_hitmask(const struct bgf *bgf, const struct atlas *atlas,
+		   struct hitmask *mask);
+// return 0 on success, -1 on error
+int write_hitmask(const char *file_name, const struct hitmask *mask);
+void free_hitmask(struct hitmask *mask);
+// builds and writes the mask of a bgf, return 0 on success, -1 on error
+int export_hitmask(const struct bgf *bgf, const struct atlas *atlas,
+		   const char *file_name);
+
+#endif
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "metadata.h"
+
+// returns the part of a path after the last "/", without modifying it
+const char *path_base(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	return slash ? slash + 1 : path;
+}
+
+// writes the members describing a whole bgf, each followed by a ","
+void write_bgf_header(FILE *fp, struct bgf *bgf)
+{
+	fprintf(fp, "\"name\":\"%s\",", bgf->bitmap_name);
+	fprintf(fp, "\"version\":%d,", bgf->version);
+	fprintf(fp, "\"sprite_count\":%d,", bgf->bitmap_count);
+	fprintf(fp, "\"group_count\":%d,", bgf->group_count);
+	fprintf(fp, "\"shrink_factor\":%d,", bgf->shrink_factor);
+}
+
+/* Writes the "sprites" and "groups" members of a bgf's json object. Sprites
+ * are placed on atlas pages, unless image_names gives each its own image file.
+ */
+void write_sprites_and_groups(FILE *fp, struct bgf *bgf, char **image_names)
+{
+	fprintf(fp, "\"sprites\":[");
+
+	for (int i = 0; i < bgf->bitmap_count; i++) {
+		struct bitmap *bitmap = bgf->bitmaps + i;
+		fprintf(fp, "{");
+		if (image_names) {
+			fprintf(fp, "\"image_file\":\"%s\",", image_names[i]);
+		} else {
+			fprintf(fp, "\"page\":%d,", bitmap->page);
+			fprintf(fp, "\"x_pos\":%d,", bitmap->x_pos);
+			fprintf(fp, "\"y_pos\":%d,", bitmap->y_pos);
+		}
+		fprintf(fp, "\"width\":%d,", bitmap->width);
+		fprintf(fp, "\"height\":%d,", bitmap->height);
+		fprintf(fp, "\"x_offset\":%d,", bitmap->x_offset);
+		fprintf(fp, "\"y_offset\":%d,", bitmap->y_offset);
+		if (bitmap->is_trimmed) {
+			fprintf(fp, "\"trim_x\":%d,", bitmap->trim_x);
+			fprintf(fp, "\"trim_y\":%d,", bitmap->trim_y);
+			fprintf(fp, "\"source_width\":%d,",
+				bitmap->source_width);
+			fprintf(fp, "\"source_height\":%d,",
+				bitmap->source_height);
+		}
+		fprintf(fp, "\"hotspot_count\":%d,",
+			bitmap->hotspot_count);
+		fprintf(fp, "\"hotspots\":[");
+		for (int j = 0; j < bitmap->hotspot_count; j++) {
+			struct hotspot *hotspot = bitmap->hotspots + j;
+			fprintf(fp, "{");
+			fprintf(fp, "\"number\":%d,",
+				hotspot->number);
+			fprintf(fp, "\"x\":%d,", hotspot->x);
+			fprintf(fp, "\"y\":%d", hotspot->y);
+			if (j == bitmap->hotspot_count - 1) {
+				fprintf(fp, "}");
+			} else {
+				fprintf(fp, "},");
+			}
+		}
+		fprintf(fp, "]");
+		if (i == bgf->bitmap_count - 1) {
+			fprintf(fp, "}");
+		} else {
+			fprintf(fp, "},");
+		}
+	}
+	fprintf(fp, "],");
+	fprintf(fp, "\"groups\":[");
+	int indexes_offset = 0;
+	for (int i = 0; i < bgf->group_count; i++) {
+		fprintf(fp, "{");
+		fprintf(fp, "\"index_count\":%d,", bgf->bitmap_groups[i]);
+		fprintf(fp, "\"indexes\":[");
+		for (int j = 0; j < bgf->bitmap_groups[i]; ++j) {
+			if (j == bgf->bitmap_groups[i] - 1) {
+				fprintf(fp, "%d]",
+					bgf->bitmap_indexes[j + indexes_offset]);
+			} else {
+				fprintf(fp, "%d,",
+					bgf->bitmap_indexes[j + indexes_offset]);
+			}
+		}
+		indexes_offset += bgf->bitmap_groups[i];
+		if (i == bgf->group_count - 1) {
+			fprintf(fp, "}");
+		} else {
+			fprintf(fp, "},");
+		}
+	}
+	fprintf(fp, "]");
+}
+
+// return 0 on success, -1 on failure
+int export_metadata(struct bgf *bgf, char *json_file_name,
+		    char **png_file_names, int page_count)
+{
+	FILE *fp = fopen(json_file_name, "w");
+
+	if (!fp) {
+		fprintf(stderr, "Error: Failed to create json %s: %s\n",
+			json_file_name, strerror(errno));
+		return -1;
+	}
+
+	fprintf(fp, "{");
+	write_bgf_header(fp, bgf);
+	fprintf(fp, "\"image_file\":\"%s\",", png_file_names[0]);
+	fprintf(fp, "\"page_count\":%d,", page_count);
+	fprintf(fp, "\"image_files\":[");
+	for (int p = 0; p < page_count; p++) {
+		fprintf(fp, "\"%s\"%s", png_file_names[p],
+			p == page_count - 1 ? "" : ",");
+	}
+	fprintf(fp, "],");
+	write_sprites_and_groups(fp, bgf, NULL);
+	fprintf(fp, "}");
+	fclose(fp);
+	return 0;
+}
+
+/* Writes the json of a bgf whose frames went to a content addressed store,
+ * every sprite names its image file inside store_dir.
+ * return 0 on success, -1 on failure
+ */
+int export_store_metadata(struct bgf *bgf, char *json_file_name,
+			  const char *store_dir, char **image_names)
+{
+	FILE *fp = fopen(json_file_name, "w");
+
+	if (!fp) {
+		fprintf(stderr, "Error: Failed to create json %s: %s\n",
+			json_file_name, strerror(errno));
+		return -1;
+	}
+
+	fprintf(fp, "{");
+	write_bgf_header(fp, bgf);
+	fprintf(fp, "\"store_dir\":\"%s\",", store_dir);
+	write_sprites_and_groups(fp, bgf, image_names);
+	fprintf(fp, "}");
+
+	if (fclose(fp)) {
+		fprintf(stderr, "Error: Failed to write json %s\n",
+			json_file_name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Writes the index of a shared atlas: the pages, then one object per bgf keyed
+ * by its file name without extension, holding the same sprites and groups as
+ * the json of a single bgf. Bgfs without bitmaps, such as the ones that failed
+ * to load, are left out.
+ * return 0 on success, -1 on failure
+ */
+int export_atlas_metadata(struct bgf *bgfs, int bgf_count, char *json_file_name,
+			  char **png_file_names, int page_count)
+{
+	FILE *fp = fopen(json_file_name, "w");
+
+	if (!fp) {
+		fprintf(stderr, "Error: Failed to create json %s: %s\n",
+			json_file_name, strerror(errno));
+		return -1;
+	}
+
+	fprintf(fp, "{");
+	fprintf(fp, "\"page_count\":%d,", page_count);
+	fprintf(fp, "\"image_files\":[");
+	for (int p = 0; p < page_count; p++) {
+		fprintf(fp, "\"%s\"%s", png_file_names[p],
+			p == page_count - 1 ? "" : ",");
+	}
+	fprintf(fp, "],");
+	fprintf(fp, "\"bgfs\":{");
+	int first = 1;
+	for (int b = 0; b < bgf_count; b++) {
+		struct bgf *bgf = bgfs + b;
+		if (bgf->bitmap_count == 0)
+			continue;
+
+		const char *key = path_base(bgf->file_name);
+		const char *dot = strrchr(key, '.');
+		int key_len = dot ? dot - key : strlen(key);
+
+		fprintf(fp, "%s\"%.*s\":{", first ? "" : ",", key_len, key);
+		write_bgf_header(fp, bgf);
+		write_sprites_and_groups(fp, bgf, NULL);
+		fprintf(fp, "}");
+		first = 0;
+	}
+	fprintf(fp, "}");
+	fprintf(fp, "}");
+
+	if (fclose(fp)) {
+		fprintf(stderr, "Error: Failed to write json %s\n",
+			json_file_name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Writes one bgf of a scan catalog: its header, then every frame as
+ * [width, height, x_offset, y_offset, compressed, data_offset, data_size,
+ * [[number, x, y], ...hotspots]] and every group as an array of frame indexes.
+ * data_offset and data_size locate the frame's pixels in the file, so a single
+ * frame can be decoded later without parsing the rest.
+ */
+void write_catalog_bgf(FILE *fp, struct bgf *bgf)
+{
+	fprintf(fp, "{\"file\":\"%s\",", bgf->file_name);
+	write_bgf_header(fp, bgf);
+	fprintf(fp, "\"frames\":[");
+	for (int i = 0; i < bgf->bitmap_count; i++) {
+		struct bitmap *bm = bgf->bitmaps + i;
+		int is_compressed = bm->format == COMPRESSED;
+		size_t data_size = is_compressed ?
+					   bm->compressed_size :
+					   (size_t)bm->width * bm->height;
+		fprintf(fp, "%s[%d,%d,%d,%d,%d,%zu,%zu,[", i ? "," : "",
+			bm->width, bm->height, bm->x_offset, bm->y_offset,
+			is_compressed, bm->data_offset, data_size);
+		for (int j = 0; j < bm->hotspot_count; j++) {
+			struct hotspot *hotspot = bm->hotspots + j;
+			fprintf(fp, "%s[%d,%d,%d]", j ? "," : "",
+				hotspot->number, hotspot->x, hotspot->y);
+		}
+		fprintf(fp, "]]");
+	}
+	fprintf(fp, "],\"groups\":[");
+	int indexes_offset = 0;
+	for (int i = 0; i < bgf->group_count; i++) {
+		fprintf(fp, "%s[", i ? "," : "");
+		for (int j = 0; j < bgf->bitmap_groups[i]; j++)
+			fprintf(fp, "%s%d", j ? "," : "",
+				bgf->bitmap_indexes[indexes_offset + j]);
+		fprintf(fp, "]");
+		indexes_offset += bgf->bitmap_groups[i];
+	}
+	fprintf(fp, "]}");
+}
+
+/* Writes the catalog of a header scan, one compact entry per bgf in input
+ * order. Files that failed to load are left out.
+ * return 0 on success, -1 on failure
+ */
+int export_catalog(struct bgf *bgfs, int bgf_count, char *json_file_name)
+{
+	FILE *fp = fopen(json_file_name, "w");
+
+	if (!fp) {
+		fprintf(stderr, "Error: Failed to create json %s: %s\n",
+			json_file_name, strerror(errno));
+		return -1;
+	}
+
+	fprintf(fp, "{\"frame_fields\":[\"width\",\"height\",\"x_offset\","
+		    "\"y_offset\",\"compressed\",\"data_offset\","
+		    "\"data_size\",\"hotspots\"],");
+	fprintf(fp, "\"bgfs\":[");
+	int first = 1;
+	for (int b = 0; b < bgf_count; b++) {
+		if (!bgfs[b].file_name)
+			continue;
+		if (!first)
+			fprintf(fp, ",\n");
+		write_catalog_bgf(fp, bgfs + b);
+		first = 0;
+	}
+	fprintf(fp, "]}\n");
+
+	if (fclose(fp)) {
+		fprintf(stderr, "Error: Failed to write json %s\n",
+			json_file_name);
+		return -1;
+	}
+	return 0;
+}
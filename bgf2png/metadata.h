@@ -0,0 +1,24 @@
+#ifndef METADATA_H
+#define METADATA_H
+
+#include <stdio.h>
+#include "bgf.h"
+
+// returns the part of a path after the last "/", without modifying it
+const char *path_base(const char *path);
+void write_bgf_header(FILE *fp, struct bgf *bgf);
+void write_sprites_and_groups(FILE *fp, struct bgf *bgf, char **image_names);
+// json of a single bgf packed into pages, return 0 on success, -1 on failure
+int export_metadata(struct bgf *bgf, char *json_file_name,
+		    char **png_file_names, int page_count);
+// json of a bgf stored frame by frame, return 0 on success, -1 on failure
+int export_store_metadata(struct bgf *bgf, char *json_file_name,
+			  const char *store_dir, char **image_names);
+// index of a shared atlas, return 0 on success, -1 on failure
+int export_atlas_metadata(struct bgf *bgfs, int bgf_count, char *json_file_name,
+			  char **png_file_names, int page_count);
+void write_catalog_bgf(FILE *fp, struct bgf *bgf);
+// header only catalog, return 0 on success, -1 on failure
+int export_catalog(struct bgf *bgfs, int bgf_count, char *json_file_name);
+
+#endif
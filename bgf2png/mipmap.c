@@ -0,0 +1,299 @@
+#include <stdlib.h>
+#include <string.h>
+#include "palette.h"
+#include "mipmap.h"
+
+// full precision state of a level, the next level is filtered from it
+struct mip_work {
+	int width, height;
+	// straight color, 3 per texel, and alpha from 0 to 1
+	float *color;
+	float *alpha;
+	// index of the rect that owns each texel, -1 outside every rect
+	int32_t *owners;
+	uint8_t *indexes;
+};
+
+static void alloc_work(struct mip_work *work, int width, int height)
+{
+	size_t count = (size_t)width * height;
+
+	work->width = width;
+	work->height = height;
+	work->color = malloc(sizeof(float) * 3 * count);
+	work->alpha = malloc(sizeof(float) * count);
+	work->owners = malloc(sizeof(int32_t) * count);
+	work->indexes = malloc(count);
+}
+
+static void free_work(struct mip_work *work)
+{
+	free(work->color);
+	free(work->alpha);
+	free(work->owners);
+	free(work->indexes);
+}
+
+/* Filters every texel of cur from its footprint in prev, a 2x2 box or 3 wide
+ * where prev has an odd size. Only the texels of the footprint's most common
+ * owner are used. Colors are weighted by alpha so transparent texels don't
+ * darken edges, and the index is the most common opaque index.
+ */
+static void filter_level(const struct mip_work *prev, struct mip_work *cur)
+{
+	for (int y = 0; y < cur->height; y++) {
+		int y0 = y * prev->height / cur->height;
+		int y1 = (y + 1) * prev->height / cur->height;
+		if (y1 == y0)
+			y1 = y0 + 1;
+
+		for (int x = 0; x < cur->width; x++) {
+			int x0 = x * prev->width / cur->width;
+			int x1 = (x + 1) * prev->width / cur->width;
+			if (x1 == x0)
+				x1 = x0 + 1;
+
+			size_t sources[9];
+			int source_count = 0;
+			for (int sy = y0; sy < y1; sy++) {
+				for (int sx = x0; sx < x1; sx++)
+					sources[source_count++] =
+						(size_t)sy * prev->width + sx;
+			}
+
+			// sprites win over the free space around them
+			int32_t owner = -1;
+			int owner_count = 0;
+			for (int i = 0; i < source_count; i++) {
+				int32_t o = prev->owners[sources[i]];
+				int count = 0;
+				if (o < 0)
+					continue;
+				for (int j = 0; j < source_count; j++)
+					count += prev->owners[sources[j]] == o;
+				if (count > owner_count) {
+					owner = o;
+					owner_count = count;
+				}
+			}
+
+			float alpha = 0;
+			float weighted[3] = { 0 }, plain[3] = { 0 };
+			int n = 0;
+			uint8_t index = TRANSPARENT_INDEX;
+			int index_count = 0;
+			for (int i = 0; i < source_count; i++) {
+				size_t s = sources[i];
+				if (prev->owners[s] != owner)
+					continue;
+				alpha += prev->alpha[s];
+				for (int c = 0; c < 3; c++) {
+					weighted[c] += prev->color[s * 3 + c] *
+						       prev->alpha[s];
+					plain[c] += prev->color[s * 3 + c];
+				}
+				n++;
+
+				uint8_t candidate = prev->indexes[s];
+				if (candidate == TRANSPARENT_INDEX)
+					continue;
+				int count = 0;
+				for (int j = 0; j < source_count; j++)
+					count += prev->owners[sources[j]] ==
+							 owner &&
+						 prev->indexes[sources[j]] ==
+							 candidate;
+				if (count > index_count) {
+					index = candidate;
+					index_count = count;
+				}
+			}
+
+			size_t d = (size_t)y * cur->width + x;
+			cur->owners[d] = owner;
+			cur->alpha[d] = alpha / n;
+			cur->indexes[d] = index;
+			for (int c = 0; c < 3; c++)
+				cur->color[d * 3 + c] = alpha > 0 ?
+								weighted[c] / alpha :
+								plain[c] / n;
+		}
+	}
+}
+
+/* Finds for every rect the alpha scale that keeps the share of texels passing
+ * an alpha test at one half the same as in level 0, so sprites neither thin
+ * out nor bloat in the distance. Alphas are binned to 256 steps to find the
+ * cut off without sorting.
+ */
+static void find_coverage_scales(const struct mip_work *work,
+				 const float *coverage, int rect_count,
+				 float *scales)
+{
+	size_t count = (size_t)work->width * work->height;
+	int *histogram = calloc((size_t)rect_count * 256, sizeof(int));
+	int *totals = calloc(rect_count, sizeof(int));
+
+	for (size_t i = 0; i < count; i++) {
+		int32_t o = work->owners[i];
+		if (o < 0)
+			continue;
+		histogram[(size_t)o * 256 + (int)(work->alpha[i] * 255 + 0.5f)]++;
+		totals[o]++;
+	}
+
+	for (int o = 0; o < rect_count; o++) {
+		int target = (int)(coverage[o] * totals[o] + 0.5f);
+		int passing = 0;
+		int bin = 255;
+
+		scales[o] = 1;
+		if (target == 0)
+			continue;
+		for (; bin > 0; bin--) {
+			passing += histogram[(size_t)o * 256 + bin];
+			if (passing >= target)
+				break;
+		}
+		if (bin > 0)
+			scales[o] = 0.5f * 255 / (bin - 0.5f);
+	}
+
+	free(totals);
+	free(histogram);
+}
+
+// writes the 8 bit outputs of a level from its work state
+static void output_level(const struct mip_work *work, const float *scales,
+			 int premultiply, struct mip_level *level)
+{
+	size_t count = (size_t)work->width * work->height;
+
+	level->width = work->width;
+	level->height = work->height;
+	level->rgba = malloc(count * 4);
+	level->indexes = malloc(count);
+
+	for (size_t i = 0; i < count; i++) {
+		float alpha = work->alpha[i];
+		if (work->owners[i] >= 0)
+			alpha *= scales[work->owners[i]];
+		if (alpha > 1)
+			alpha = 1;
+
+		for (int c = 0; c < 3; c++) {
+			float color = work->color[i * 3 + c];
+			if (premultiply)
+				color *= alpha;
+			level->rgba[i * 4 + c] = color + 0.5f;
+		}
+		level->rgba[i * 4 + 3] = alpha * 255 + 0.5f;
+		level->indexes[i] =
+			alpha >= 0.5f ? work->indexes[i] : TRANSPARENT_INDEX;
+	}
+}
+
+int build_mipmaps(const struct bitmap *bitmap, const struct mip_rect *rects,
+		  int rect_count, int premultiply, int max_levels,
+		  struct mip_level **levels)
+{
+	struct mip_rect whole = { 0, 0, bitmap->width, bitmap->height };
+	int width = bitmap->width, height = bitmap->height;
+	size_t count = (size_t)width * height;
+	uint32_t lut[256];
+
+	if (!rects) {
+		rects = &whole;
+		rect_count = 1;
+	}
+
+	int level_count = 1;
+	while ((width >> level_count) > 0 || (height >> level_count) > 0)
+		level_count++;
+	if (max_levels > 0 && level_count > max_levels)
+		level_count = max_levels;
+
+	*levels = calloc(level_count, sizeof(**levels));
+
+	// level 0 is the bitmap as it is
+	struct mip_level *level = *levels;
+	level->width = width;
+	level->height = height;
+	level->rgba = malloc(count * 4);
+	level->indexes = malloc(count);
+	make_rgba_lut(lut, premultiply);
+	expand_indexes(lut, bitmap->image_bytes, count, level->rgba);
+	memcpy(level->indexes, bitmap->image_bytes, count);
+
+	if (level_count == 1)
+		return 1;
+
+	struct mip_work prev, cur;
+	alloc_work(&prev, width, height);
+	make_rgba_lut(lut, 0);
+	for (size_t i = 0; i < count; i++) {
+		uint32_t color = lut[bitmap->image_bytes[i]];
+		prev.color[i * 3] = color & 0xFF;
+		prev.color[i * 3 + 1] = (color >> 8) & 0xFF;
+		prev.color[i * 3 + 2] = (color >> 16) & 0xFF;
+		prev.alpha[i] = (color >> 24) / 255.0f;
+		prev.owners[i] = -1;
+	}
+	memcpy(prev.indexes, bitmap->image_bytes, count);
+
+	for (int r = 0; r < rect_count; r++) {
+		for (int y = rects[r].y; y < rects[r].y + rects[r].height; y++) {
+			if (y < 0 || y >= height)
+				continue;
+			for (int x = rects[r].x; x < rects[r].x + rects[r].width;
+			     x++) {
+				if (x >= 0 && x < width)
+					prev.owners[(size_t)y * width + x] = r;
+			}
+		}
+	}
+
+	// share of opaque texels of every rect, kept at every level
+	float *coverage = calloc(rect_count, sizeof(float));
+	float *scales = malloc(sizeof(float) * rect_count);
+	int *totals = calloc(rect_count, sizeof(int));
+	for (size_t i = 0; i < count; i++) {
+		int32_t o = prev.owners[i];
+		if (o < 0)
+			continue;
+		totals[o]++;
+		coverage[o] += prev.alpha[i];
+	}
+	for (int r = 0; r < rect_count; r++)
+		coverage[r] = totals[r] ? coverage[r] / totals[r] : 0;
+	free(totals);
+
+	for (int l = 1; l < level_count; l++) {
+		int w = prev.width / 2 > 0 ? prev.width / 2 : 1;
+		int h = prev.height / 2 > 0 ? prev.height / 2 : 1;
+
+		alloc_work(&cur, w, h);
+		filter_level(&prev, &cur);
+		find_coverage_scales(&cur, coverage, rect_count, scales);
+		output_level(&cur, scales, premultiply, *levels + l);
+
+		// the next level filters the alpha tested indexes
+		memcpy(cur.indexes, (*levels)[l].indexes, (size_t)w * h);
+		free_work(&prev);
+		prev = cur;
+	}
+
+	free_work(&prev);
+	free(scales);
+	free(coverage);
+	return level_count;
+}
+
+void free_mipmaps(struct mip_level *levels, int level_count)
+{
+	for (int l = 0; l < level_count; l++) {
+		free(levels[l].rgba);
+		free(levels[l].indexes);
+	}
+	free(levels);
+}
@@ -0,0 +1,33 @@
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include "bgf.h"
+
+// area a sprite owns in an image, including its gutter
+struct mip_rect {
+	int x, y;
+	int width, height;
+};
+
+/* One level of a mip chain, as RGBA8 and as palette indexes. Texels whose
+ * alpha falls under one half are TRANSPARENT_INDEX in indexes.
+ */
+struct mip_level {
+	int width, height;
+	uint8_t *rgba;
+	uint8_t *indexes;
+};
+
+/* Builds up to max_levels levels of a mip chain of a palette bitmap, level 0
+ * being the bitmap itself, or the whole chain down to 1x1 if max_levels is 0.
+ * Every texel of a smaller level is filtered only from texels of the rect
+ * that covers most of its footprint, so sprites don't bleed into each other.
+ * With no rects the whole image is one sprite.
+ * return the number of levels
+ */
+int build_mipmaps(const struct bitmap *bitmap, const struct mip_rect *rects,
+		  int rect_count, int premultiply, int max_levels,
+		  struct mip_level **levels);
+void free_mipmaps(struct mip_level *levels, int level_count);
+
+#endif
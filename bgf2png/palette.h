@@ -0,0 +1,18 @@
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+// MERIDIAN 59 COLOR PALETTE, 0xRRGGBB per index
+extern const uint32_t hex_palette[256];
+
+void make_rgba_lut(uint32_t lut[256], int premultiply);
+// return 1 if expand_indexes runs a vectorized kernel on this cpu
+int has_simd_expand();
+void expand_indexes_scalar(const uint32_t lut[256], const uint8_t *indexes,
+			   size_t count, uint8_t *rgba);
+void expand_indexes(const uint32_t lut[256], const uint8_t *indexes,
+		    size_t count, uint8_t *rgba);
+
+#endif
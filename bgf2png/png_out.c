@@ -0,0 +1,558 @@
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include "png.h"
+#include "zlib.h"
+#include "palette.h"
+#include "png_out.h"
+
+const char *png_preset_names[PNG_PRESET_COUNT] = { "fast", "default",
+						   "smallest" };
+
+// raw bytes of filtered rows deflated by each thread of a parallel encode
+#define PNG_BAND_SIZE (256 * 1024)
+// images smaller than this are encoded on one thread
+#define PNG_PARALLEL_SIZE (1024 * 1024)
+#define PNG_IDAT_SIZE (1024 * 1024)
+
+// filters and strategies tried by PNG_PRESET_SMALLEST
+static const int search_filters[] = { PNG_FILTER_NONE, PNG_FILTER_SUB,
+				      PNG_FILTER_UP,   PNG_FILTER_AVG,
+				      PNG_FILTER_PAETH, PNG_ALL_FILTERS };
+static const int search_strategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED,
+					 Z_RLE };
+
+int find_png_preset(const char *name)
+{
+	for (int i = 0; i < PNG_PRESET_COUNT; i++) {
+		if (strcmp(name, png_preset_names[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+// growing output buffer libpng writes the encoded file into
+struct png_buffer {
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+};
+
+static void append_png_buffer(struct png_buffer *buffer, const void *data,
+			      size_t length)
+{
+	if (buffer->size + length > buffer->capacity) {
+		size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+		while (capacity < buffer->size + length)
+			capacity *= 2;
+		buffer->data = realloc(buffer->data, capacity);
+		buffer->capacity = capacity;
+	}
+
+	memcpy(buffer->data + buffer->size, data, length);
+	buffer->size += length;
+}
+
+static void write_png_buffer(png_structp png_ptr, png_bytep data,
+			     png_size_t length)
+{
+	append_png_buffer(png_get_io_ptr(png_ptr), data, length);
+}
+
+/* Encodes bitmap with the given row filter and zlib level and strategy, or
+ * libpng's own choices where filter or level is -1.
+ * return 0 on success, -1 on error
+ */
+static int encode_png_with(const struct bitmap *bitmap, int filter, int level,
+			   int strategy, struct png_buffer *buffer)
+{
+	png_structp png_ptr;
+	png_infop info_ptr;
+	png_color palette[256];
+	png_byte trans_alpha[256];
+
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
+					  NULL);
+
+	if (!png_ptr) {
+		fprintf(stderr, "Error: Failed to initialize libpng struct\n");
+		return -1;
+	}
+
+	info_ptr = png_create_info_struct(png_ptr);
+
+	if (!info_ptr) {
+		png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+		fprintf(stderr,
+			"Error: Failed to initialize libpng info struct\n");
+		return -1;
+	}
+
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		return -1;
+	}
+
+	buffer->size = 0;
+	// no flush callback, png_write_flush and png_set_flush are never used
+	png_set_write_fn(png_ptr, buffer, write_png_buffer, NULL);
+
+	if (filter != -1)
+		png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, filter);
+	if (level != -1) {
+		png_set_compression_level(png_ptr, level);
+		png_set_compression_mem_level(png_ptr, 9);
+		png_set_compression_strategy(png_ptr, strategy);
+	}
+
+	png_set_IHDR(png_ptr, info_ptr, bitmap->width, bitmap->height, 8,
+		     PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
+		     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+	for (int i = 0; i < 256; i++) {
+		palette[i].red = (hex_palette[i] & 0xFF0000) >> 16;
+		palette[i].green = (hex_palette[i] & 0x00FF00) >> 8;
+		palette[i].blue = hex_palette[i] & 0x0000FF;
+		trans_alpha[i] = 255;
+	}
+
+	trans_alpha[TRANSPARENT_INDEX] = 0;
+
+	png_set_tRNS(png_ptr, info_ptr, trans_alpha, 256, NULL);
+
+	png_set_PLTE(png_ptr, info_ptr, palette, 256);
+
+	png_write_info(png_ptr, info_ptr);
+
+	// rows go straight from the bitmap, no row pointer array needed
+	for (int i = 0; i < bitmap->height; i++)
+		png_write_row(png_ptr, bitmap->image_bytes +
+					       (size_t)bitmap->width * i);
+
+	png_write_end(png_ptr, NULL);
+
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	return 0;
+}
+
+static void append_u32_be(struct png_buffer *buffer, uint32_t value)
+{
+	uint8_t bytes[4] = { value >> 24, value >> 16, value >> 8, value };
+	append_png_buffer(buffer, bytes, 4);
+}
+
+// appends a png chunk with its length, type and crc
+static void append_chunk(struct png_buffer *buffer, const char *type,
+			 const uint8_t *data, uint32_t length)
+{
+	append_u32_be(buffer, length);
+	append_png_buffer(buffer, type, 4);
+	if (length)
+		append_png_buffer(buffer, data, length);
+
+	// crc32 with a NULL buffer returns its initial value, not crc
+	uLong crc = crc32(0, (const Bytef *)type, 4);
+	if (length)
+		crc = crc32(crc, data, length);
+	append_u32_be(buffer, crc);
+}
+
+/* A horizontal band of rows deflated on its own. Every band but the last ends
+ * in a sync flush on a byte boundary, so the raw deflate output of all bands
+ * concatenates into a single valid stream.
+ */
+struct deflate_band {
+	int first_row;
+	int row_count;
+	struct png_buffer out;
+	uLong adler;
+	size_t raw_size;
+	int result;
+};
+
+struct deflate_queue {
+	const struct bitmap *bitmap;
+	int level;
+	struct deflate_band *bands;
+	int band_count;
+	int next_band;
+	pthread_mutex_t lock;
+};
+
+/* Runs deflate with flush on whatever input is left, growing the output as
+ * needed. return 0 on success, -1 on error
+ */
+static int deflate_into(z_stream *zs, struct png_buffer *out, int flush)
+{
+	int ret;
+
+	do {
+		if (out->capacity - out->size < 65536) {
+			out->capacity = out->capacity * 2 + 65536;
+			out->data = realloc(out->data, out->capacity);
+		}
+		zs->next_out = out->data + out->size;
+		zs->avail_out = out->capacity - out->size;
+		ret = deflate(zs, flush);
+		out->size = out->capacity - zs->avail_out;
+		if (ret == Z_STREAM_ERROR)
+			return -1;
+	} while (zs->avail_out == 0 ||
+		 (flush == Z_FINISH && ret != Z_STREAM_END));
+
+	return 0;
+}
+
+/* Deflates the filtered rows of a band, primed with the last 32K of filtered
+ * rows before it so matches can still reach back across the band boundary.
+ * Rows use filter type none, the usual best choice for palette images.
+ * return 0 on success, -1 on error
+ */
+static int deflate_band(const struct bitmap *bitmap, int level, int is_last,
+			struct deflate_band *band)
+{
+	const uint8_t filter = PNG_FILTER_VALUE_NONE;
+	size_t row_size = (size_t)bitmap->width + 1;
+	z_stream zs = { 0 };
+
+	if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) !=
+	    Z_OK)
+		return -1;
+
+	if (band->first_row > 0) {
+		int dict_rows = (32768 + row_size - 1) / row_size;
+		if (dict_rows > band->first_row)
+			dict_rows = band->first_row;
+
+		uint8_t *dict = malloc(row_size * dict_rows);
+		for (int r = 0; r < dict_rows; r++) {
+			int y = band->first_row - dict_rows + r;
+			dict[r * row_size] = filter;
+			memcpy(dict + r * row_size + 1,
+			       bitmap->image_bytes + (size_t)bitmap->width * y,
+			       bitmap->width);
+		}
+
+		size_t dict_size = row_size * dict_rows;
+		size_t skip = dict_size > 32768 ? dict_size - 32768 : 0;
+		deflateSetDictionary(&zs, dict + skip, dict_size - skip);
+		free(dict);
+	}
+
+	band->adler = adler32(0, NULL, 0);
+	band->raw_size = row_size * band->row_count;
+
+	int result = 0;
+	for (int r = 0; r < band->row_count && result == 0; r++) {
+		const uint8_t *row = bitmap->image_bytes +
+				     (size_t)bitmap->width *
+					     (band->first_row + r);
+		int flush = Z_NO_FLUSH;
+		if (r == band->row_count - 1)
+			flush = is_last ? Z_FINISH : Z_SYNC_FLUSH;
+
+		band->adler = adler32(band->adler, &filter, 1);
+		band->adler = adler32(band->adler, row, bitmap->width);
+
+		zs.next_in = (Bytef *)&filter;
+		zs.avail_in = 1;
+		result = deflate_into(&zs, &band->out, Z_NO_FLUSH);
+		if (result)
+			break;
+		zs.next_in = (Bytef *)row;
+		zs.avail_in = bitmap->width;
+		result = deflate_into(&zs, &band->out, flush);
+	}
+
+	deflateEnd(&zs);
+	return result;
+}
+
+static void *deflate_worker(void *arg)
+{
+	struct deflate_queue *queue = arg;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		int i = queue->next_band++;
+		pthread_mutex_unlock(&queue->lock);
+
+		if (i >= queue->band_count)
+			break;
+
+		queue->bands[i].result =
+			deflate_band(queue->bitmap, queue->level,
+				     i == queue->band_count - 1,
+				     queue->bands + i);
+	}
+
+	return NULL;
+}
+
+/* Encodes a png without libpng, deflating bands of rows on thread_count
+ * threads at once and stitching them into a single zlib stream, whose
+ * checksum is combined from the checksums of the bands.
+ * return 0 on success, -1 on error
+ */
+static int encode_png_parallel(const struct bitmap *bitmap, int level,
+			       int thread_count, struct png_buffer *buffer)
+{
+	size_t row_size = (size_t)bitmap->width + 1;
+	int band_rows = (PNG_BAND_SIZE + row_size - 1) / row_size;
+	int band_count = (bitmap->height + band_rows - 1) / band_rows;
+	struct deflate_queue queue = { 0 };
+
+	queue.bitmap = bitmap;
+	queue.level = level;
+	queue.band_count = band_count;
+	queue.bands = calloc(band_count, sizeof(*queue.bands));
+	for (int i = 0; i < band_count; i++) {
+		queue.bands[i].first_row = i * band_rows;
+		queue.bands[i].row_count = bitmap->height - i * band_rows;
+		if (queue.bands[i].row_count > band_rows)
+			queue.bands[i].row_count = band_rows;
+	}
+	pthread_mutex_init(&queue.lock, NULL);
+
+	if (thread_count > band_count)
+		thread_count = band_count;
+
+	// whatever the threads that couldn't be started leave is deflated here
+	pthread_t *threads = malloc(sizeof(*threads) * thread_count);
+	int started = 0;
+	for (int i = 0; threads && i < thread_count; i++) {
+		if (pthread_create(&threads[started], NULL, deflate_worker,
+				   &queue) == 0)
+			started++;
+	}
+	if (started < thread_count)
+		deflate_worker(&queue);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&queue.lock);
+
+	int result = 0;
+	for (int i = 0; i < band_count; i++)
+		result |= queue.bands[i].result;
+
+	if (result == 0) {
+		// zlib header with the level hint, checked to be a multiple of 31
+		int level_hint = level == Z_DEFAULT_COMPRESSION ? 2 :
+				 level < 2			? 0 :
+				 level < 6			? 1 :
+				 level == 6			? 2 :
+								  3;
+		uint8_t header[2] = { 0x78, level_hint << 6 };
+		header[1] += 31 - (header[0] * 256 + header[1]) % 31;
+
+		struct png_buffer stream = { 0 };
+		uLong adler = adler32(0, NULL, 0);
+		append_png_buffer(&stream, header, 2);
+		for (int i = 0; i < band_count; i++) {
+			struct deflate_band *band = queue.bands + i;
+			append_png_buffer(&stream, band->out.data,
+					  band->out.size);
+			adler = adler32_combine(adler, band->adler,
+						band->raw_size);
+		}
+		append_u32_be(&stream, adler);
+
+		uint8_t ihdr[13] = { 0 };
+		uint8_t palette[256 * 3];
+		uint8_t trans_alpha[256];
+		ihdr[0] = bitmap->width >> 24;
+		ihdr[1] = bitmap->width >> 16;
+		ihdr[2] = bitmap->width >> 8;
+		ihdr[3] = bitmap->width;
+		ihdr[4] = bitmap->height >> 24;
+		ihdr[5] = bitmap->height >> 16;
+		ihdr[6] = bitmap->height >> 8;
+		ihdr[7] = bitmap->height;
+		ihdr[8] = 8;
+		ihdr[9] = PNG_COLOR_TYPE_PALETTE;
+		for (int i = 0; i < 256; i++) {
+			palette[i * 3] = (hex_palette[i] & 0xFF0000) >> 16;
+			palette[i * 3 + 1] = (hex_palette[i] & 0x00FF00) >> 8;
+			palette[i * 3 + 2] = hex_palette[i] & 0x0000FF;
+			trans_alpha[i] = 255;
+		}
+		trans_alpha[TRANSPARENT_INDEX] = 0;
+
+		static const uint8_t signature[8] = { 137, 80, 78, 71,
+						      13,  10, 26, 10 };
+		buffer->size = 0;
+		append_png_buffer(buffer, signature, sizeof(signature));
+		append_chunk(buffer, "IHDR", ihdr, sizeof(ihdr));
+		append_chunk(buffer, "PLTE", palette, sizeof(palette));
+		append_chunk(buffer, "tRNS", trans_alpha, sizeof(trans_alpha));
+		for (size_t pos = 0; pos < stream.size; pos += PNG_IDAT_SIZE) {
+			size_t length = stream.size - pos;
+			if (length > PNG_IDAT_SIZE)
+				length = PNG_IDAT_SIZE;
+			append_chunk(buffer, "IDAT", stream.data + pos, length);
+		}
+		append_chunk(buffer, "IEND", NULL, 0);
+		free(stream.data);
+	}
+
+	for (int i = 0; i < band_count; i++)
+		free(queue.bands[i].out.data);
+	free(queue.bands);
+	return result ? -1 : 0;
+}
+
+int encode_png(const struct bitmap *bitmap, int preset, int thread_count,
+	       uint8_t **png, size_t *png_size)
+{
+	struct png_buffer best = { 0 };
+	size_t raw_size = ((size_t)bitmap->width + 1) * bitmap->height;
+	int result;
+
+	// small images don't have enough rows to be worth splitting
+	int parallel = thread_count > 1 && raw_size >= PNG_PARALLEL_SIZE;
+
+	if (parallel && preset != PNG_PRESET_SMALLEST) {
+		result = encode_png_parallel(bitmap,
+					     preset == PNG_PRESET_FAST ?
+						     1 :
+						     Z_DEFAULT_COMPRESSION,
+					     thread_count, &best);
+	} else if (preset == PNG_PRESET_FAST) {
+		result = encode_png_with(bitmap, PNG_FILTER_NONE, 1,
+					 Z_DEFAULT_STRATEGY, &best);
+	} else if (preset == PNG_PRESET_SMALLEST) {
+		struct png_buffer candidate = { 0 };
+		int filter_count = sizeof(search_filters) /
+				   sizeof(search_filters[0]);
+		int strategy_count = sizeof(search_strategies) /
+				     sizeof(search_strategies[0]);
+		int best_filter = 0;
+		int best_strategy = 0;
+
+		/* level 9 costs several times level 6 on long transparent
+		 * runs, so the combinations are ranked at level 6 and only the
+		 * winner is encoded again at level 9
+		 */
+		result = 0;
+		for (int f = 0; f < filter_count && result == 0; f++) {
+			for (int s = 0; s < strategy_count && result == 0;
+			     s++) {
+				result = encode_png_with(bitmap,
+							 search_filters[f], 6,
+							 search_strategies[s],
+							 &candidate);
+				if (result || (best.data &&
+					       candidate.size >= best.size))
+					continue;
+
+				// keep the smaller one, reuse the other buffer
+				struct png_buffer swap = best;
+				best = candidate;
+				candidate = swap;
+				best_filter = f;
+				best_strategy = s;
+			}
+		}
+
+		if (result == 0)
+			result = encode_png_with(bitmap,
+						 search_filters[best_filter], 9,
+						 search_strategies[best_strategy],
+						 &candidate);
+		if (result == 0 && candidate.size < best.size) {
+			struct png_buffer swap = best;
+			best = candidate;
+			candidate = swap;
+		}
+		free(candidate.data);
+	} else {
+		result = encode_png_with(bitmap, -1, -1, 0, &best);
+	}
+
+	if (result) {
+		free(best.data);
+		return -1;
+	}
+
+	*png = best.data;
+	*png_size = best.size;
+	return 0;
+}
+
+int write_png(const char *file_name, const struct bitmap *bitmap, int preset,
+	      int thread_count)
+{
+	uint8_t *png;
+	size_t png_size;
+
+	if (encode_png(bitmap, preset, thread_count, &png, &png_size)) {
+		fprintf(stderr, "Error: Failed to encode png %s\n", file_name);
+		return -1;
+	}
+
+	FILE *fp = fopen(file_name, "wb");
+
+	if (!fp) {
+		fprintf(stderr, "Error: Failed to create png %s: %s\n",
+			file_name, strerror(errno));
+		free(png);
+		return -1;
+	}
+
+	size_t written = fwrite(png, 1, png_size, fp);
+	free(png);
+
+	if (fclose(fp) || written != png_size) {
+		fprintf(stderr, "Error: Failed to write png %s\n", file_name);
+		return -1;
+	}
+
+	return 0;
+}
+
+int write_gray_png(const char *file_name, const struct bitmap *bitmap)
+{
+	png_structp png_ptr;
+	png_infop info_ptr;
+	FILE *fp = fopen(file_name, "wb");
+
+	if (!fp) {
+		fprintf(stderr, "Error: Failed to create png %s: %s\n",
+			file_name, strerror(errno));
+		return -1;
+	}
+
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL,
+					  NULL);
+	info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+
+	if (!info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		fclose(fp);
+		fprintf(stderr, "Error: Failed to encode png %s\n", file_name);
+		return -1;
+	}
+
+	png_init_io(png_ptr, fp);
+	png_set_IHDR(png_ptr, info_ptr, bitmap->width, bitmap->height, 8,
+		     PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
+		     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_write_info(png_ptr, info_ptr);
+	for (int i = 0; i < bitmap->height; i++)
+		png_write_row(png_ptr, bitmap->image_bytes +
+					       (size_t)bitmap->width * i);
+	png_write_end(png_ptr, NULL);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+
+	if (fclose(fp)) {
+		fprintf(stderr, "Error: Failed to write png %s\n", file_name);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef PNG_OUT_H
+#define PNG_OUT_H
+
+#include <stddef.h>
+#include "bgf.h"
+
+// CONSTANTS
+/* how hard to compress: level 1 without filtering, libpng's defaults, or the
+ * smallest result of trying every filter and zlib strategy, finished at level 9
+ */
+#define PNG_PRESET_FAST 0
+#define PNG_PRESET_DEFAULT 1
+#define PNG_PRESET_SMALLEST 2
+#define PNG_PRESET_COUNT 3
+
+extern const char *png_preset_names[PNG_PRESET_COUNT];
+
+// return the preset called name, -1 if there is none
+int find_png_preset(const char *name);
+/* Encodes a palette png into a malloced buffer. Large images are deflated in
+ * bands on thread_count threads, except with PNG_PRESET_SMALLEST.
+ * return 0 on success, -1 on error
+ */
+int encode_png(const struct bitmap *bitmap, int preset, int thread_count,
+	       uint8_t **png, size_t *png_size);
+// return 0 on success, -1 on error
+int write_png(const char *file_name, const struct bitmap *bitmap, int preset,
+	      int thread_count);
+/* Writes the bytes of bitmap as a grayscale png, with libpng's defaults.
+ * return 0 on success, -1 on error
+ */
+int write_gray_png(const char *file_name, const struct bitmap *bitmap);
+
+#endif
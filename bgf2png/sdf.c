@@ -0,0 +1,250 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "sdf.h"
+
+// bounds of the lower envelope, beyond any squared distance
+#define SDF_FAR 1e20f
+// distance along a column without a source, squared it still fits a float
+#define SDF_FAR_COLUMN 1e6f
+
+/* The one dimensional squared distance transform of Felzenszwalb and
+ * Huttenlocher: d[q] = min over p of (q - p)^2 + f[p], found in linear time as
+ * the lower envelope of the parabolas rooted at every p. v and z need room for
+ * n and n + 1 entries.
+ */
+static void edt_1d(const float *f, int n, float *d, int *v, float *z)
+{
+	int k = 0;
+
+	v[0] = 0;
+	z[0] = -SDF_FAR;
+	z[1] = SDF_FAR;
+	for (int q = 1; q < n; q++) {
+		float s;
+		// drop the parabolas q hides, z[0] stops this at the first
+		for (;;) {
+			int p = v[k];
+			s = ((f[q] + (float)q * q) - (f[p] + (float)p * p)) /
+			    (2 * (q - p));
+			if (s > z[k])
+				break;
+			k--;
+		}
+		k++;
+		v[k] = q;
+		z[k] = s;
+		z[k + 1] = SDF_FAR;
+	}
+
+	k = 0;
+	for (int q = 0; q < n; q++) {
+		while (z[k + 1] < q)
+			k++;
+		d[q] = (float)(q - v[k]) * (q - v[k]) + f[v[k]];
+	}
+}
+
+// scratch buffers of one thread, sized for the largest rect
+struct sdf_scratch {
+	uint8_t *opaque;
+	float *grid;
+	float *f;
+	float *z;
+	int *v;
+};
+
+/* Squared distance from every texel of a width x height grid to the nearest
+ * texel whose opaque flag is source, exact up to reach and above reach
+ * squared beyond it. Along columns that is just the distance to the nearest
+ * source above or below, found by sweeping down and back up a row at a time,
+ * and only the rows need the full transform.
+ */
+static void edt_2d(const uint8_t *opaque, int source, int width, int height,
+		   int reach, float *grid, struct sdf_scratch *scratch)
+{
+	for (int y = 0; y < height; y++) {
+		const uint8_t *row = opaque + (size_t)y * width;
+		float *g = grid + (size_t)y * width;
+		for (int x = 0; x < width; x++) {
+			if (row[x] == source)
+				g[x] = 0;
+			else
+				g[x] = y > 0 ? g[x - width] + 1 : SDF_FAR_COLUMN;
+		}
+	}
+
+	for (int y = height - 2; y >= 0; y--) {
+		float *g = grid + (size_t)y * width;
+		for (int x = 0; x < width; x++) {
+			if (g[x] > g[x + width] + 1)
+				g[x] = g[x + width] + 1;
+		}
+	}
+
+	// rows farther than reach from every source only need to stay that far
+	for (int y = 0; y < height; y++) {
+		float *row = grid + (size_t)y * width;
+		float nearest = SDF_FAR_COLUMN;
+		for (int x = 0; x < width; x++) {
+			scratch->f[x] = row[x] * row[x];
+			if (row[x] < nearest)
+				nearest = row[x];
+		}
+		if (nearest > reach)
+			memcpy(row, scratch->f, sizeof(*row) * width);
+		else
+			edt_1d(scratch->f, width, row, scratch->v, scratch->z);
+	}
+}
+
+/* Fills the field of one rect. The grid has a border of one texel, which
+ * counts as outside, so sprites touching the edge of the rect still get an
+ * outline there. Pixels of the margin are outside whatever a gutter put in
+ * them.
+ */
+static void build_rect_sdf(const struct bitmap *bitmap,
+			   const struct mip_rect *rect, int pad, int spread,
+			   struct sdf_scratch *scratch, struct bitmap *sdf)
+{
+	int width = rect->width + 2;
+	int height = rect->height + 2;
+	uint8_t *opaque = scratch->opaque;
+	float *grid = scratch->grid;
+	float *inside = grid + (size_t)width * height;
+
+	memset(opaque, 0, (size_t)width * height);
+	for (int y = pad; y < rect->height - pad; y++) {
+		const uint8_t *row = bitmap->image_bytes +
+				     (size_t)(rect->y + y) * bitmap->width +
+				     rect->x;
+		uint8_t *out = opaque + (size_t)(y + 1) * width + 1;
+		for (int x = pad; x < rect->width - pad; x++)
+			out[x] = row[x] != TRANSPARENT_INDEX;
+	}
+
+	// anything past spread is clamped anyway
+	edt_2d(opaque, 1, width, height, spread + 1, grid, scratch);
+	edt_2d(opaque, 0, width, height, spread + 1, inside, scratch);
+
+	// the outline lies half way between an opaque and a transparent pixel
+	for (int y = 1; y < height - 1; y++) {
+		uint8_t *out = sdf->image_bytes +
+			       (size_t)(rect->y + y - 1) * sdf->width + rect->x;
+		for (int x = 1; x < width - 1; x++) {
+			size_t i = (size_t)y * width + x;
+			float distance = grid[i] > 0 ? 0.5f - sqrtf(grid[i]) :
+						       sqrtf(inside[i]) - 0.5f;
+			if (distance > spread)
+				distance = spread;
+			if (distance < -spread)
+				distance = -spread;
+			float scale = distance > 0 ? 127 : 128;
+			out[x - 1] = SDF_EDGE + lrintf(distance * scale / spread);
+		}
+	}
+}
+
+// shared state of the threads building the field of one rect each
+struct sdf_queue {
+	const struct bitmap *bitmap;
+	const struct mip_rect *rects;
+	int rect_count;
+	int pad;
+	int spread;
+	int max_width;
+	int max_height;
+	struct bitmap *sdf;
+	int next_rect;
+	pthread_mutex_t lock;
+};
+
+static void *sdf_worker(void *arg)
+{
+	struct sdf_queue *queue = arg;
+	struct sdf_scratch scratch;
+	int width = queue->max_width + 2;
+	int height = queue->max_height + 2;
+
+	scratch.opaque = malloc((size_t)width * height);
+	scratch.grid = malloc(sizeof(float) * 2 * width * height);
+	scratch.f = malloc(sizeof(float) * width);
+	scratch.z = malloc(sizeof(float) * (width + 1));
+	scratch.v = malloc(sizeof(int) * width);
+
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		int i = queue->next_rect++;
+		pthread_mutex_unlock(&queue->lock);
+
+		if (i >= queue->rect_count)
+			break;
+
+		build_rect_sdf(queue->bitmap, queue->rects + i, queue->pad,
+			       queue->spread, &scratch, queue->sdf);
+	}
+
+	free(scratch.opaque);
+	free(scratch.grid);
+	free(scratch.f);
+	free(scratch.z);
+	free(scratch.v);
+	return NULL;
+}
+
+void build_sdf(const struct bitmap *bitmap, const struct mip_rect *rects,
+	       int rect_count, int pad, int spread, int thread_count,
+	       struct bitmap *sdf)
+{
+	struct mip_rect whole = { 0, 0, bitmap->width, bitmap->height };
+	struct sdf_queue queue = { 0 };
+
+	memset(sdf, 0, sizeof(*sdf));
+	sdf->width = bitmap->width;
+	sdf->height = bitmap->height;
+	sdf->image_bytes =
+		calloc((size_t)bitmap->width * bitmap->height + 1, 1);
+
+	if (!rects) {
+		rects = &whole;
+		rect_count = 1;
+		pad = 0;
+	}
+
+	queue.bitmap = bitmap;
+	queue.rects = rects;
+	queue.rect_count = rect_count;
+	queue.pad = pad;
+	queue.spread = spread;
+	queue.sdf = sdf;
+	for (int i = 0; i < rect_count; i++) {
+		if (rects[i].width > queue.max_width)
+			queue.max_width = rects[i].width;
+		if (rects[i].height > queue.max_height)
+			queue.max_height = rects[i].height;
+	}
+	pthread_mutex_init(&queue.lock, NULL);
+
+	if (thread_count > rect_count)
+		thread_count = rect_count;
+	if (thread_count <= 1) {
+		sdf_worker(&queue);
+	} else {
+		// whatever the threads that couldn't be started leave is
+		// built here
+		pthread_t *threads = malloc(sizeof(*threads) * thread_count);
+		int started = 0;
+		for (int i = 0; threads && i < thread_count; i++) {
+			if (pthread_create(&threads[started], NULL, sdf_worker,
+					   &queue) == 0)
+				started++;
+		}
+		if (started < thread_count)
+			sdf_worker(&queue);
+		for (int i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+		free(threads);
+	}
+	pthread_mutex_destroy(&queue.lock);
+}
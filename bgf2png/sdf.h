@@ -0,0 +1,23 @@
+#ifndef SDF_H
+#define SDF_H
+
+#include "bgf.h"
+#include "mipmap.h"
+
+// CONSTANTS
+// value of the outline of a sprite, texels inside it are above
+#define SDF_EDGE 128
+
+/* Builds the signed distance field of a palette image into sdf, with the same
+ * size and layout. Every rect is a sprite surrounded by pad pixels of margin,
+ * the margin only holds distances to its own sprite and everything outside
+ * the rects is 0. With no rects the whole image is one sprite. Distances in
+ * pixels map to SDF_EDGE plus 127 / spread per pixel inside and minus
+ * 128 / spread per pixel outside, clamped at spread. Sprites are spread over
+ * thread_count threads.
+ */
+void build_sdf(const struct bitmap *bitmap, const struct mip_rect *rects,
+	       int rect_count, int pad, int spread, int thread_count,
+	       struct bitmap *sdf);
+
+#endif
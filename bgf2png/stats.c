@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+const char *stats_phase_names[STATS_PHASE_COUNT] = { "load", "decode", "pack",
+						     "encode", "metadata" };
+
+double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void end_phase(struct stats *stats, int phase, double *start)
+{
+	double now = now_seconds();
+	stats->phase_seconds[phase] += now - *start;
+	*start = now;
+}
+
+void count_bgf(struct stats *stats, const struct bgf *bgf)
+{
+	stats->file_count++;
+	stats->frame_count += bgf->bitmap_count;
+	stats->bytes_read += bgf->size;
+}
+
+void count_inflated(struct stats *stats, const struct bgf *bgf)
+{
+	for (int i = 0; i < bgf->bitmap_count; i++)
+		stats->bytes_inflated += (uint64_t)bgf->bitmaps[i].width *
+					 bgf->bitmaps[i].height;
+}
+
+// duplicates share the rectangle of the bitmap they match
+void count_atlas(struct stats *stats, const struct bgf *bgfs, int bgf_count,
+		 const struct atlas *atlas)
+{
+	for (int b = 0; b < bgf_count; b++) {
+		for (int i = 0; i < bgfs[b].bitmap_count; i++) {
+			const struct bitmap *bm = bgfs[b].bitmaps + i;
+			if (!bm->duplicate_of)
+				stats->packed_area +=
+					(uint64_t)bm->width * bm->height;
+		}
+	}
+
+	for (int p = 0; p < atlas->page_count; p++)
+		stats->page_area +=
+			(uint64_t)atlas->pages[p].width * atlas->pages[p].height;
+	stats->page_count += atlas->page_count;
+}
+
+uint64_t file_size(const char *file_name)
+{
+	struct stat st;
+
+	if (stat(file_name, &st))
+		return 0;
+	return st.st_size;
+}
+
+void merge_stats(struct stats *total, const struct stats *part)
+{
+	pthread_mutex_lock(&total->lock);
+	for (int i = 0; i < STATS_PHASE_COUNT; i++)
+		total->phase_seconds[i] += part->phase_seconds[i];
+	total->file_count += part->file_count;
+	total->frame_count += part->frame_count;
+	total->bytes_read += part->bytes_read;
+	total->bytes_inflated += part->bytes_inflated;
+	total->packed_area += part->packed_area;
+	total->page_area += part->page_area;
+	total->page_count += part->page_count;
+	total->image_bytes += part->image_bytes;
+	total->metadata_bytes += part->metadata_bytes;
+	pthread_mutex_unlock(&total->lock);
+}
+
+/* Peak memory is the resident set size getrusage reports for the whole
+ * process, in kilobytes on Linux.
+ */
+void print_stats(FILE *fp, const struct stats *stats, int format,
+		 double wall_seconds)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	long peak_kb = usage.ru_maxrss;
+	double fill = stats->page_area ?
+			      (double)stats->packed_area / stats->page_area :
+			      0;
+
+	if (format == STATS_JSON) {
+		fprintf(fp, "{\"wall_seconds\":%.6f,\"phase_seconds\":{",
+			wall_seconds);
+		for (int i = 0; i < STATS_PHASE_COUNT; i++)
+			fprintf(fp, "%s\"%s\":%.6f", i ? "," : "",
+				stats_phase_names[i], stats->phase_seconds[i]);
+		fprintf(fp,
+			"},\"file_count\":%d,\"frame_count\":%" PRIu64
+			",\"bytes_read\":%" PRIu64
+			",\"bytes_inflated\":%" PRIu64
+			",\"page_count\":%d,\"packed_area\":%" PRIu64
+			",\"page_area\":%" PRIu64 ",\"fill_ratio\":%.4f"
+			",\"image_bytes\":%" PRIu64
+			",\"metadata_bytes\":%" PRIu64
+			",\"peak_rss_kb\":%ld}\n",
+			stats->file_count, stats->frame_count,
+			stats->bytes_read, stats->bytes_inflated,
+			stats->page_count, stats->packed_area,
+			stats->page_area, fill, stats->image_bytes,
+			stats->metadata_bytes, peak_kb);
+		return;
+	}
+
+	fprintf(fp, "Stats: %d files, %" PRIu64 " frames in %.3f s\n",
+		stats->file_count, stats->frame_count, wall_seconds);
+	for (int i = 0; i < STATS_PHASE_COUNT; i++)
+		fprintf(fp, "  %-9s %10.3f s\n", stats_phase_names[i],
+			stats->phase_seconds[i]);
+	fprintf(fp, "  read      %10.2f MB\n", stats->bytes_read / 1e6);
+	fprintf(fp, "  inflated  %10.2f MB\n", stats->bytes_inflated / 1e6);
+	fprintf(fp, "  packed    %10d pages, %.1f%% filled\n",
+		stats->page_count, fill * 100);
+	fprintf(fp, "  images    %10.2f MB\n", stats->image_bytes / 1e6);
+	fprintf(fp, "  metadata  %10.2f MB\n", stats->metadata_bytes / 1e6);
+	fprintf(fp, "  peak rss  %10.2f MB\n", peak_kb / 1e3);
+	fprintf(fp, "  phase times are summed over files converted at once\n");
+}
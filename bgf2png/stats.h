@@ -0,0 +1,65 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "bgf.h"
+#include "atlas.h"
+
+// CONSTANTS
+// phases of a conversion, timed separately
+#define STATS_LOAD 0
+#define STATS_DECODE 1
+#define STATS_PACK 2
+#define STATS_ENCODE 3
+#define STATS_METADATA 4
+#define STATS_PHASE_COUNT 5
+
+#define STATS_TEXT 0
+#define STATS_JSON 1
+
+extern const char *stats_phase_names[STATS_PHASE_COUNT];
+
+/* Counters of a run. Every conversion fills its own struct stats without
+ * locking and merges it into the run's total when done, so the times of
+ * phases are summed over files converted at the same time on different
+ * threads.
+ */
+struct stats {
+	double phase_seconds[STATS_PHASE_COUNT];
+	int file_count;
+	uint64_t frame_count;
+	// size of the input files
+	uint64_t bytes_read;
+	// pixels inflated, one byte each
+	uint64_t bytes_inflated;
+	// pixels of packed bitmaps and of the pages they were packed into
+	uint64_t packed_area;
+	uint64_t page_area;
+	int page_count;
+	uint64_t image_bytes;
+	uint64_t metadata_bytes;
+	pthread_mutex_t lock;
+};
+
+// return a monotonic time in seconds
+double now_seconds(void);
+// adds the seconds since *start to phase and moves *start to now
+void end_phase(struct stats *stats, int phase, double *start);
+// counts the input file and frames of a loaded bgf
+void count_bgf(struct stats *stats, const struct bgf *bgf);
+// counts the pixels inflated for every frame of a bgf
+void count_inflated(struct stats *stats, const struct bgf *bgf);
+// counts the packed pixels of bgfs and the area of the atlas they are on
+void count_atlas(struct stats *stats, const struct bgf *bgfs, int bgf_count,
+		 const struct atlas *atlas);
+// return the size of a written file, 0 if it can't be found
+uint64_t file_size(const char *file_name);
+// adds the counters of part to total under total's lock
+void merge_stats(struct stats *total, const struct stats *part);
+// prints the totals of a run that took wall_seconds
+void print_stats(FILE *fp, const struct stats *stats, int format,
+		 double wall_seconds);
+
+#endif
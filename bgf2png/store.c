@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "zlib.h"
+#include "store.h"
+#include "atlas.h"
+
+// return 0 on success, -1 on error
+int init_store(struct store *store, const char *dir)
+{
+	memset(store, 0, sizeof(*store));
+
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		fprintf(stderr, "Error: Failed to create directory %s: %s\n",
+			dir, strerror(errno));
+		return -1;
+	}
+
+	store->dir = dir;
+	store->capacity = 1024;
+	store->keys = calloc(store->capacity, sizeof(*store->keys));
+	pthread_mutex_init(&store->lock, NULL);
+	pthread_cond_init(&store->written, NULL);
+	return 0;
+}
+
+/* Returns the slot of key in an open addressed table of power of two size,
+ * either the slot holding it or the free slot it belongs in
+ */
+static struct store_key *find_key(struct store_key *keys, size_t capacity,
+				  const struct store_key *key)
+{
+	size_t mask = capacity - 1;
+	size_t i = key->hash & mask;
+
+	while (keys[i].state &&
+	       (keys[i].hash != key->hash || keys[i].crc != key->crc ||
+		keys[i].width != key->width || keys[i].height != key->height))
+		i = (i + 1) & mask;
+
+	return keys + i;
+}
+
+static void grow_keys(struct store *store)
+{
+	size_t capacity = store->capacity * 2;
+	struct store_key *keys = calloc(capacity, sizeof(*keys));
+
+	for (size_t i = 0; i < store->capacity; i++) {
+		if (store->keys[i].state)
+			*find_key(keys, capacity, store->keys + i) =
+				store->keys[i];
+	}
+
+	free(store->keys);
+	store->keys = keys;
+	store->capacity = capacity;
+}
+
+/* Sets the state of a key in the table and wakes up the threads waiting for
+ * it, with store->lock held
+ */
+static void set_key_state(struct store *store, const struct store_key *key,
+			  int state)
+{
+	find_key(store->keys, store->capacity, key)->state = state;
+	pthread_cond_broadcast(&store->written);
+}
+
+/* Frames are named by a 64 bit FNV-1a hash and a crc32 of their pixels, along
+ * with their size, so telling two different frames apart only relies on both
+ * checksums not colliding at once.
+ */
+int claim_bitmap(struct store *store, const struct bitmap *bitmap,
+		 const char *suffix, struct store_key *key,
+		 char name[STORE_NAME_LEN])
+{
+	size_t size = (size_t)bitmap->width * bitmap->height;
+
+	memset(key, 0, sizeof(*key));
+	key->hash = hash_bitmap(bitmap);
+	key->crc = crc32(0, bitmap->image_bytes, size);
+	key->width = bitmap->width;
+	key->height = bitmap->height;
+	key->state = STORE_KEY_WRITING;
+
+	snprintf(name, STORE_NAME_LEN, "%016" PRIx64 "%08" PRIx32 "_%dx%d%s",
+		 key->hash, key->crc, key->width, key->height, suffix);
+
+	// the table can grow while waiting, so the slot is looked up again
+	pthread_mutex_lock(&store->lock);
+	struct store_key *slot = find_key(store->keys, store->capacity, key);
+	while (slot->state == STORE_KEY_WRITING) {
+		pthread_cond_wait(&store->written, &store->lock);
+		slot = find_key(store->keys, store->capacity, key);
+	}
+
+	int is_new = slot->state != STORE_KEY_WRITTEN;
+	if (!slot->state) {
+		*slot = *key;
+		store->key_count++;
+		if (store->key_count * 2 > store->capacity)
+			grow_keys(store);
+	} else if (is_new) {
+		// the write of an earlier claim failed, so this one retries it
+		slot->state = STORE_KEY_WRITING;
+	} else {
+		store->reused_count++;
+	}
+	pthread_mutex_unlock(&store->lock);
+
+	if (!is_new)
+		return 0;
+
+	// an image written by an earlier run only has to be referenced
+	struct stat st;
+	size_t path_len = strlen(store->dir) + STORE_NAME_LEN + 2;
+	char *path = malloc(path_len);
+	snprintf(path, path_len, "%s/%s", store->dir, name);
+	int exists = stat(path, &st) == 0;
+	free(path);
+	if (!exists)
+		return 1;
+
+	pthread_mutex_lock(&store->lock);
+	set_key_state(store, key, STORE_KEY_WRITTEN);
+	store->reused_count++;
+	pthread_mutex_unlock(&store->lock);
+	return 0;
+}
+
+void finish_bitmap(struct store *store, const struct store_key *key,
+		   int result)
+{
+	pthread_mutex_lock(&store->lock);
+	set_key_state(store, key,
+		      result ? STORE_KEY_FAILED : STORE_KEY_WRITTEN);
+	if (result == 0)
+		store->stored_count++;
+	pthread_mutex_unlock(&store->lock);
+}
+
+void free_store(struct store *store)
+{
+	free(store->keys);
+	pthread_mutex_destroy(&store->lock);
+	pthread_cond_destroy(&store->written);
+	memset(store, 0, sizeof(*store));
+}
@@ -0,0 +1,62 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <pthread.h>
+#include "bgf.h"
+
+// CONSTANTS
+// "<16 hex hash><8 hex crc>_<width>x<height><suffix>" and a null terminator
+#define STORE_NAME_LEN 96
+// longest suffix, such as "_rgba_pm_mip.dds"
+#define STORE_SUFFIX_LEN 32
+
+// states of an image in the store, a free slot of the table is 0
+#define STORE_KEY_WRITING 1
+#define STORE_KEY_WRITTEN 2
+#define STORE_KEY_FAILED 3
+
+struct store_key {
+	uint64_t hash;
+	uint32_t crc;
+	int32_t width, height;
+	// one of the STORE_KEY_ states
+	int state;
+};
+
+/* A directory of frame images named after their contents, shared by every
+ * conversion of a batch. The set of names handed out so far is kept in memory
+ * along with whether each image is written yet, so every unique image is
+ * written only once per run, and images left by earlier runs are reused.
+ */
+struct store {
+	const char *dir;
+	struct store_key *keys;
+	size_t key_count;
+	size_t capacity;
+	int stored_count;
+	int reused_count;
+	pthread_mutex_t lock;
+	// signalled whenever an image stops being written
+	pthread_cond_t written;
+};
+
+// return 0 on success, -1 on error
+int init_store(struct store *store, const char *dir);
+/* Names a decoded bitmap by its pixels and suffix, which holds the extension
+ * and anything else telling apart images of the same pixels, such as their
+ * format. Waits while another thread writes the same image, so a name handed
+ * out as stored always refers to a complete file.
+ * return 1 if the caller has to write the image and pass key to
+ * finish_bitmap, 0 if it was stored already
+ */
+int claim_bitmap(struct store *store, const struct bitmap *bitmap,
+		 const char *suffix, struct store_key *key,
+		 char name[STORE_NAME_LEN]);
+/* Marks an image claimed by the caller as written, result being 0, or as
+ * failed, in which case the next claim of it writes it again.
+ */
+void finish_bitmap(struct store *store, const struct store_key *key,
+		   int result);
+void free_store(struct store *store);
+
+#endif